@@ -0,0 +1,221 @@
+// Boots the device's own main on the simulated micro:bit and works it through the menu from the buttons and the
+// serial commands, the way a person would, then checks what it sends over serial.
+#include "MicroBit.h"
+#include "HighScoreManager.h"
+#include <stdio.h>
+#include <string>
+
+// From source/main.cpp, main renamed for the host build.
+extern MicroBit uBit;
+int DeviceMain();
+
+// How long a button is held for, and left between presses (us).
+#define TEST_PRESS_TIME 100000
+
+// Longest a test waits for the device to finish something (us).
+#define TEST_TIMEOUT 60000000
+
+// Input pins of the menu buttons, from Buttons in main.cpp.
+#define TEST_MIDDLE_PIN 3
+#define TEST_RIGHT_PIN 6
+
+// Loopback modes, up from the first mode in the menu.
+#define TEST_LOOPBACK_STEPS 5
+
+#define TEST_LOOPBACK_EDGES 2000
+
+// Scores in flash when the device starts.
+#define TEST_SCORES 12
+
+void DeviceFiber(void * param)
+{
+    (void)param;
+    DeviceMain();
+}
+
+// Lets the device run until the given time.
+void RunUntil(uint64_t time)
+{
+    while (SimTime() < time)
+    {
+        SimSleepUntil(time);
+    }
+}
+
+void Press(int pin)
+{
+    SimSetButtons(1 << pin);
+    RunUntil(SimTime() + TEST_PRESS_TIME);
+    SimSetButtons(0);
+    RunUntil(SimTime() + TEST_PRESS_TIME);
+}
+
+// Lets the device run until text turns up in its serial output. Returns false if it never does.
+bool WaitForSerial(const char * text)
+{
+    uint64_t end = SimTime() + TEST_TIMEOUT;
+    while (SimSerialOutput().find(text) == std::string::npos)
+    {
+        if (SimTime() >= end)
+        {
+            return false;
+        }
+        RunUntil(SimTime() + TEST_PRESS_TIME);
+    }
+    return true;
+}
+
+// Checks the summary of one loopback run got every edge.
+int CheckLoopback(const char * label)
+{
+    std::string heading = std::string("LOOPBACK ") + label + " ";
+    size_t position = SimSerialOutput().find(heading);
+    if (position == std::string::npos)
+    {
+        printf("No LOOPBACK %s summary\n", label);
+        return 1;
+    }
+
+    int edges = 0;
+    int detected = 0;
+    int minimum = 0;
+    int average = 0;
+    int maximum = 0;
+    const char * summary = SimSerialOutput().c_str() + position + heading.length();
+    if (sscanf(summary, "EDGES:%d DETECTED:%d\n\rLATENCY(us) MIN:%d AVG:%d MAX:%d", &edges, &detected, &minimum, &average,
+               &maximum) != 5)
+    {
+        printf("LOOPBACK %s summary isn't complete\n", label);
+        return 1;
+    }
+
+    printf("LOOPBACK %s EDGES:%d DETECTED:%d LATENCY(us) MIN:%d AVG:%d MAX:%d\n", label, edges, detected, minimum, average,
+           maximum);
+
+    if (edges != TEST_LOOPBACK_EDGES || detected != edges || minimum <= 0 || minimum > average || average > maximum)
+    {
+        printf("LOOPBACK %s didn't see every edge through the wire\n", label);
+        return 1;
+    }
+    return 0;
+}
+
+// Picks the hidden loopback mode with button B held, and fits the wire once the benchmark has started. With it
+// fitted, port B pin 7 reads as held and the menu would wait for it to be let go.
+int TestLoopback()
+{
+    SimSetButtonB(true);
+    for (int i = 0; i < TEST_LOOPBACK_STEPS; i++)
+    {
+        Press(TEST_RIGHT_PIN);
+    }
+    SimSetButtonB(false);
+
+    // The benchmark starts as soon as the middle button is let go.
+    SimClearSerial();
+    SimSetButtons(1 << TEST_MIDDLE_PIN);
+    RunUntil(SimTime() + TEST_PRESS_TIME);
+    SimWatchOutputs(true);
+    SimSetButtons(0);
+
+    uint64_t end = SimTime() + TEST_TIMEOUT;
+    bool started = false;
+    while (!started && SimTime() < end)
+    {
+        uint64_t time;
+        ManagedString shown;
+        while (SimTakeDisplayChange(&time, &shown))
+        {
+            started |= shown == ManagedString("L");
+        }
+        if (!started)
+        {
+            SimSleepUntil(end);
+        }
+    }
+    SimWatchOutputs(false);
+
+    if (!started)
+    {
+        printf("The loopback benchmark never started\n");
+        return 1;
+    }
+
+    SimSetLoopbackWire(true);
+    bool finished = WaitForSerial("LOOPBACK MODEL");
+    SimSetLoopbackWire(false);
+
+    if (!finished)
+    {
+        printf("The loopback benchmark never finished\n");
+        return 1;
+    }
+
+    // Each summary goes out in one go, so it's all there once its first line is.
+    return CheckLoopback("HW") + CheckLoopback("MODEL");
+}
+
+// Stores scores in the flash for the device to find when it starts.
+void StoreScores()
+{
+    HighScoreManager scores;
+    scores.Initialise(&uBit);
+    scores.Reset();
+    for (int i = 0; i < TEST_SCORES; i++)
+    {
+        scores.AddEntry(250 + i * 10, 1);
+    }
+}
+
+// Sends the b command from the menu and checks both ways of reading the scores found all of them. Flash reads
+// don't take any simulated time, so the times it sends are next to nothing; HighScoreTest compares the two.
+int TestScoreBenchmark()
+{
+    SimClearSerial();
+    SimSendSerial("b");
+    if (!WaitForSerial("GETSCORE N:"))
+    {
+        printf("The b command didn't answer\n");
+        return 1;
+    }
+
+    int streamed = 0;
+    int streamTime = 0;
+    int found = 0;
+    int lookupTime = 0;
+    const char * output = SimSerialOutput().c_str() + SimSerialOutput().find("STREAM N:");
+    if (sscanf(output, "STREAM N:%d TIME(us):%d\n\rGETSCORE N:%d TIME(us):%d", &streamed, &streamTime, &found,
+               &lookupTime) != 4)
+    {
+        printf("The b command's answer isn't complete\n");
+        return 1;
+    }
+
+    printf("STREAM N:%d TIME(us):%d GETSCORE N:%d TIME(us):%d\n", streamed, streamTime, found, lookupTime);
+
+    if (streamed != TEST_SCORES || found != TEST_SCORES)
+    {
+        printf("The b command didn't read back every score\n");
+        return 1;
+    }
+    return 0;
+}
+
+int main()
+{
+    SimMarkExternal();
+    SimSetSpinSkip(true);
+    StoreScores();
+    create_fiber(DeviceFiber, NULL);
+
+    // Past the start up message.
+    RunUntil(SimTime() + 6000000);
+
+    int failures = TestLoopback();
+
+    // Back at the menu.
+    RunUntil(SimTime() + 1000000);
+    failures += TestScoreBenchmark();
+
+    return failures == 0 ? 0 : 1;
+}
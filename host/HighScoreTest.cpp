@@ -0,0 +1,375 @@
+// Checks the score log on the simulated flash. A script of games and resets is run once to find out how many
+// bytes of flash it changes, then again with the power cut after every one of those bytes. Each time the scores
+// read back afterwards have to be the ones from before or after the change that was going on, and the log has
+// to take a new score.
+#include "MicroBit.h"
+#include "HighScoreManager.h"
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+
+// Scores added before, between and after the two resets. Enough to fill the log and move it between pages.
+#define TEST_FIRST_GAMES 25
+#define TEST_SECOND_GAMES 30
+#define TEST_THIRD_GAMES 8
+
+// Added after recovering, to check the log still takes scores.
+#define TEST_RECOVERY_TIME 1234
+
+// Times every score is read back when comparing ReadEntries with GetScore. A full log is only 34 scores, so one
+// pass is too quick to time on its own.
+#define TEST_READ_PASSES 20000
+
+// Where the simulation puts the end of the program to start with.
+#define TEST_PROGRAM_END (64 * 1024)
+
+static MicroBit TestBit;
+
+struct Operation
+{
+    // False for a reset.
+    bool Add;
+    uint32_t Time;
+    uint8_t Mode;
+};
+
+// Everything a reader can see of the scores.
+struct ScoreState
+{
+    int NumberOfEntries;
+    unsigned int BestTime;
+    std::vector<ScoreEntry> Entries;
+    std::vector<uint32_t> Times;
+};
+
+static void WipeLog()
+{
+    for (int page = 0; page < SCORE_LOG_PAGES; page++)
+    {
+        memset(SimFlashPage(NRF_FICR->CODESIZE - SCORE_LOG_PAGE_OFFSET + page), 0xFF, SimFlashPageSize());
+    }
+}
+
+static std::vector<Operation> Script()
+{
+    std::vector<Operation> script;
+    int games[] = {TEST_FIRST_GAMES, TEST_SECOND_GAMES, TEST_THIRD_GAMES};
+
+    for (int part = 0; part < 3; part++)
+    {
+        if (part > 0)
+        {
+            Operation reset = {false, 0, 0};
+            script.push_back(reset);
+        }
+
+        for (int i = 0; i < games[part]; i++)
+        {
+            Operation add = {true, (uint32_t)(200 + (i * 137 + part * 59) % 400), (uint8_t)(1 + i % 4)};
+            script.push_back(add);
+        }
+    }
+
+    return script;
+}
+
+static bool Run(HighScoreManager * manager, const Operation & operation)
+{
+    if (operation.Add)
+        return manager->AddEntry(operation.Time, operation.Mode) != SCORE_NO_ID;
+
+    return manager->Reset();
+}
+
+static ScoreState Capture(HighScoreManager * manager)
+{
+    ScoreState state;
+    state.NumberOfEntries = manager->GetNumberOfEntries();
+    state.BestTime = manager->GetBestTime();
+
+    ScoreEntry buffer[4];
+    int cursor = 0;
+    int count;
+    while ((count = manager->ReadEntries(buffer, 4, &cursor, NULL)) > 0)
+    {
+        state.Entries.insert(state.Entries.end(), buffer, buffer + count);
+    }
+
+    for (int id = 0; id < state.NumberOfEntries; id++)
+    {
+        uint32_t time;
+        state.Times.push_back(manager->GetScore(id, &time) ? time : 0xFFFFFFFF);
+    }
+
+    return state;
+}
+
+static bool SameState(const ScoreState & a, const ScoreState & b)
+{
+    if (a.NumberOfEntries != b.NumberOfEntries || a.BestTime != b.BestTime || a.Times != b.Times)
+        return false;
+    if (a.Entries.size() != b.Entries.size())
+        return false;
+
+    for (size_t i = 0; i < a.Entries.size(); i++)
+    {
+        if (a.Entries[i].Id != b.Entries[i].Id || a.Entries[i].Time != b.Entries[i].Time || a.Entries[i].Mode != b.Entries[i].Mode)
+            return false;
+    }
+    return true;
+}
+
+// Cuts the power after every byte the script writes or erases, and checks what's read back.
+static int TestPowerLoss()
+{
+    std::vector<Operation> script = Script();
+    std::vector<ScoreState> expected;
+
+    WipeLog();
+    SimSetFlashBudget(-1);
+    uint64_t start = SimFlashBytesChanged();
+
+    HighScoreManager full;
+    full.Initialise(&TestBit);
+    expected.push_back(Capture(&full));
+    for (size_t i = 0; i < script.size(); i++)
+    {
+        if (!Run(&full, script[i]))
+        {
+            printf("Operation %d failed with the power on\n", (int)i);
+            return 1;
+        }
+        expected.push_back(Capture(&full));
+    }
+
+    int64_t total = SimFlashBytesChanged() - start;
+    int failures = 0;
+
+    for (int64_t cut = 0; cut <= total; cut++)
+    {
+        WipeLog();
+        SimSetFlashBudget(cut);
+
+        // The operation that was going on when the power went.
+        size_t lost = script.size();
+        HighScoreManager device;
+        device.Initialise(&TestBit);
+        for (size_t i = 0; i < script.size(); i++)
+        {
+            Run(&device, script[i]);
+            if (SimFlashBudget() == 0)
+            {
+                lost = i;
+                break;
+            }
+        }
+
+        SimSetFlashBudget(-1);
+        HighScoreManager recovered;
+        recovered.Initialise(&TestBit);
+        ScoreState state = Capture(&recovered);
+
+        bool before = SameState(state, expected[lost]);
+        bool after = lost < script.size() && SameState(state, expected[lost + 1]);
+        if (!before && !after)
+        {
+            printf("Power cut after %lld of %lld bytes, during operation %d: read back %d scores, best %u\n", (long long)cut, (long long)total, (int)lost, state.NumberOfEntries, state.BestTime);
+            failures++;
+            continue;
+        }
+
+        uint16_t id = recovered.AddEntry(TEST_RECOVERY_TIME, 1);
+        HighScoreManager restarted;
+        restarted.Initialise(&TestBit);
+        uint32_t time;
+        if (id == SCORE_NO_ID || restarted.GetNumberOfEntries() != state.NumberOfEntries + 1 || !restarted.GetScore(id, &time) || time != TEST_RECOVERY_TIME)
+        {
+            printf("Power cut after %lld of %lld bytes: the log didn't take a score afterwards\n", (long long)cut, (long long)total);
+            failures++;
+        }
+    }
+
+    printf("POWERLOSS CUTS:%lld FAILURES:%d\n", (long long)total + 1, failures);
+    return failures;
+}
+
+// AddEntry has to say when it couldn't store the score.
+static int TestAddEntryFailures()
+{
+    int failures = 0;
+
+    WipeLog();
+    SimSetFlashBudget(-1);
+    HighScoreManager manager;
+    manager.Initialise(&TestBit);
+
+    // Someone else's score is staged, it's theirs to commit.
+    manager.Stage(500, 1);
+    if (manager.AddEntry(300, 1) != SCORE_NO_ID)
+    {
+        printf("AddEntry went ahead with a score already staged\n");
+        failures++;
+    }
+    manager.Commit();
+    uint32_t time;
+    if (manager.GetNumberOfEntries() != 1 || !manager.GetScore(0, &time) || time != 500)
+    {
+        printf("The staged score wasn't the one committed\n");
+        failures++;
+    }
+
+    // Fill the log until there's no room left, even after moving it to the other page.
+    int added = 1;
+    uint16_t id;
+    while ((id = manager.AddEntry(400, 2)) != SCORE_NO_ID)
+    {
+        if (id != added)
+        {
+            printf("AddEntry gave ID %d for score %d\n", id, added);
+            failures++;
+            break;
+        }
+        added++;
+        if (added > 1000)
+        {
+            printf("The log never filled up\n");
+            return failures + 1;
+        }
+    }
+
+    HighScoreManager restarted;
+    restarted.Initialise(&TestBit);
+    if (manager.GetNumberOfEntries() != added || restarted.GetNumberOfEntries() != added)
+    {
+        printf("A full log changed the scores\n");
+        failures++;
+    }
+
+    // A reset makes room again.
+    if (!manager.Reset() || manager.AddEntry(300, 1) != 0)
+    {
+        printf("The log didn't take a score after a reset\n");
+        failures++;
+    }
+
+    printf("ADDENTRY CAPACITY:%d FAILURES:%d\n", added, failures);
+    return failures;
+}
+
+// A program that has grown into the log's pages mustn't have them erased or written for scores.
+static int TestProgramOverlap()
+{
+    int failures = 0;
+
+    WipeLog();
+    SimSetFlashBudget(-1);
+    HighScoreManager before;
+    before.Initialise(&TestBit);
+    before.AddEntry(300, 1);
+
+    // Ends one word into the first log page.
+    SimSetProgramEnd((NRF_FICR->CODESIZE - SCORE_LOG_PAGE_OFFSET) * NRF_FICR->CODEPAGESIZE + 4);
+    uint64_t start = SimFlashBytesChanged();
+
+    HighScoreManager manager;
+    if (manager.Initialise(&TestBit))
+    {
+        printf("Initialise didn't see the program runs into the log\n");
+        failures++;
+    }
+    if (manager.AddEntry(400, 1) != SCORE_NO_ID || manager.Reset() || manager.GetNumberOfEntries() != 0)
+    {
+        printf("The log took a change with the program running into it\n");
+        failures++;
+    }
+    if (SimFlashBytesChanged() != start)
+    {
+        printf("The log's pages were written with the program running into them\n");
+        failures++;
+    }
+
+    SimSetProgramEnd(TEST_PROGRAM_END);
+    HighScoreManager after;
+    uint32_t time;
+    if (!after.Initialise(&TestBit) || after.GetNumberOfEntries() != 1 || !after.GetScore(0, &time) || time != 300)
+    {
+        printf("The score from before wasn't there afterwards\n");
+        failures++;
+    }
+
+    printf("OVERLAP FAILURES:%d\n", failures);
+    return failures;
+}
+
+static double WallTime()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Reads back a full log by streaming it with ReadEntries and by looking up each ID with GetScore, which has to
+// search the log every time, and reports how long a pass of each takes. Flash reads cost nothing on the
+// simulation, so these are host times and only the difference between them means anything. A full log is 34
+// scores, and that's as long as the history gets.
+static int TestReadSpeed()
+{
+    WipeLog();
+    SimSetFlashBudget(-1);
+    HighScoreManager manager;
+    manager.Initialise(&TestBit);
+    for (int i = 0; manager.AddEntry((uint32_t)(200 + i * 7), (uint8_t)(1 + i % 4)) != SCORE_NO_ID; i++)
+    {
+    }
+
+    int count = manager.GetNumberOfEntries();
+    uint64_t streamedSum = 0;
+    uint64_t lookedUpSum = 0;
+
+    double start = WallTime();
+    for (int pass = 0; pass < TEST_READ_PASSES; pass++)
+    {
+        ScoreEntry buffer[8];
+        int cursor = 0;
+        int read;
+        while ((read = manager.ReadEntries(buffer, 8, &cursor, NULL)) > 0)
+        {
+            for (int i = 0; i < read; i++)
+            {
+                streamedSum += buffer[i].Time;
+            }
+        }
+    }
+    double streamTime = WallTime() - start;
+
+    start = WallTime();
+    for (int pass = 0; pass < TEST_READ_PASSES; pass++)
+    {
+        for (int id = 0; id < count; id++)
+        {
+            uint32_t time;
+            if (manager.GetScore(id, &time))
+            {
+                lookedUpSum += time;
+            }
+        }
+    }
+    double lookupTime = WallTime() - start;
+
+    printf("READ N:%d STREAM(ns):%.0f GETSCORE(ns):%.0f\n", count, streamTime * 1e9 / TEST_READ_PASSES,
+           lookupTime * 1e9 / TEST_READ_PASSES);
+
+    if (streamedSum != lookedUpSum)
+    {
+        printf("ReadEntries and GetScore read back different scores\n");
+        return 1;
+    }
+    return 0;
+}
+
+int main()
+{
+    int failures = TestPowerLoss() + TestAddEntryFailures() + TestProgramOverlap() + TestReadSpeed();
+
+    return failures == 0 ? 0 : 1;
+}
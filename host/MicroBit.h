@@ -0,0 +1,240 @@
+#ifndef __MICROBIT_HOST__
+#define __MICROBIT_HOST__
+// Host stand-in for the parts of the micro:bit runtime the game uses, so the sources in source/ build and run
+// on a PC. Time is simulated: it only moves when the code does something that would take time on the device
+// (reading the clock or a pin, an i2c transfer, a trip through the scheduler) or when every fiber is asleep.
+// The expander on the i2c bus is a model of the MCP23017, with its interrupt output on P8.
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#define MICROBIT_OK 0
+#define MICROBIT_INVALID_PARAMETER -1001
+#define MICROBIT_NO_RESOURCES -1005
+#define MICROBIT_I2C_ERROR -1010
+#define MICROBIT_NO_DATA -1011
+
+#define MICROBIT_STORAGE_MAGIC 0xCAFE
+#define MICROBIT_STORAGE_KEY_SIZE 16
+#define MICROBIT_STORAGE_VALUE_SIZE 32
+#define MICROBIT_STORAGE_BLOCK_SIZE 48
+#define MICROBIT_STORAGE_STORE_PAGE_OFFSET 17
+
+#define MICROBIT_DEFAULT_SCROLL_SPEED 120
+
+enum MicroBitSerialMode{
+    ASYNC,
+    SYNC_SPINWAIT,
+    SYNC_SLEEP
+};
+
+class ManagedString{
+    public:
+    ManagedString() {}
+    ManagedString(const char * str) : Text(str) {}
+    ManagedString(const char c) : Text(1, c) {}
+    ManagedString(const int value) : Text(std::to_string(value)) {}
+
+    int length() const { return (int)Text.length(); }
+    const char * toCharArray() const { return Text.c_str(); }
+    char charAt(int index) const { return index < length() ? Text[index] : 0; }
+
+    ManagedString operator+(const ManagedString & other) const { ManagedString s; s.Text = Text + other.Text; return s; }
+    bool operator==(const ManagedString & other) const { return Text == other.Text; }
+
+    private:
+    std::string Text;
+};
+
+class MicroBitImage{
+    public:
+    MicroBitImage() : Glyph(0) {}
+    MicroBitImage(int width, int height) : Glyph(0) { (void)width; (void)height; }
+    explicit MicroBitImage(const char * s) : Glyph(s[0]) {}
+
+    int print(char c, int x = 0, int y = 0) { (void)x; (void)y; Glyph = c; return MICROBIT_OK; }
+
+    // The character last printed into the image.
+    char Glyph;
+};
+
+class MicroBitDisplay{
+    public:
+    int print(char c, int delay = 0);
+    int print(ManagedString s, int delay = 0);
+    int print(MicroBitImage image, int x = 0, int y = 0, int alpha = 0, int delay = 0);
+    int scrollAsync(ManagedString s, int delay = MICROBIT_DEFAULT_SCROLL_SPEED);
+    int scrollAsync(int number, int delay = MICROBIT_DEFAULT_SCROLL_SPEED);
+    void stopAnimation();
+    void clear();
+
+    // What was last put on the display, for checking from a harness.
+    ManagedString Shown;
+};
+
+class MicroBitSerial{
+    public:
+    int send(ManagedString s, MicroBitSerialMode mode = ASYNC);
+    // Returns the next character sent to the device, or MICROBIT_NO_DATA.
+    int read(MicroBitSerialMode mode = SYNC_SLEEP);
+};
+
+class MicroBitI2C{
+    public:
+    int write(int address, const char * data, int length, bool repeated = false);
+    int read(int address, char * data, int length, bool repeated = false);
+};
+
+class MicroBitPin{
+    public:
+    MicroBitPin(int name) : Name(name) {}
+    int getDigitalValue();
+
+    private:
+    int Name;
+};
+
+class MicroBitIO{
+    public:
+    MicroBitIO() : P8(8) {}
+    MicroBitPin P8;
+};
+
+class MicroBitButton{
+    public:
+    MicroBitButton(int id) : Id(id) {}
+    int isPressed();
+
+    private:
+    int Id;
+};
+
+struct KeyValuePair{
+    uint8_t key[MICROBIT_STORAGE_KEY_SIZE];
+    uint8_t value[MICROBIT_STORAGE_VALUE_SIZE];
+};
+
+struct KeyValueStore{
+    uint32_t magic;
+    uint32_t size;
+};
+
+// Keeps the same page layout as the real MicroBitStorage, so code reading the page directly still works.
+class MicroBitStorage{
+    public:
+    int put(const char * key, uint8_t * data, int dataSize);
+    int put(ManagedString key, uint8_t * data, int dataSize);
+    KeyValuePair * get(const char * key);
+    KeyValuePair * get(ManagedString key);
+    int remove(const char * key);
+    int remove(ManagedString key);
+    int size();
+    void flashPageErase(uint32_t * page_address);
+    void flashWordWrite(uint32_t * address, uint32_t value);
+};
+
+class MicroBit{
+    public:
+    MicroBit() : buttonA(1), buttonB(2) {}
+    void init() {}
+
+    MicroBitDisplay display;
+    MicroBitSerial serial;
+    MicroBitI2C i2c;
+    MicroBitIO io;
+    MicroBitStorage storage;
+    MicroBitButton buttonA;
+    MicroBitButton buttonB;
+};
+
+struct NRF_FICR_Type{
+    uint32_t CODEPAGESIZE;
+    uint32_t CODESIZE;
+};
+
+extern NRF_FICR_Type * NRF_FICR;
+
+struct Fiber;
+
+uint32_t us_ticker_read();
+void wait_ms(int ms);
+void fiber_sleep(unsigned long t);
+void schedule();
+
+// Not part of the runtime. Spin loops in the game hand over with SCHEDULE_UNTIL, saying when (us_ticker_read
+// time) they next have anything to do, and on the device that's a plain schedule(). See SimSetSpinSkip.
+void schedule_until(uint32_t time);
+#define SCHEDULE_UNTIL(time) schedule_until(time)
+
+// Not part of the runtime. Where the program image ends in flash, which the device gets from its linker script.
+// See SimSetProgramEnd.
+uint32_t program_image_end();
+#define PROGRAM_IMAGE_END program_image_end()
+
+Fiber * create_fiber(void (*entry_fn)(void *), void * param);
+void release_fiber();
+int itoa(int n, char * s);
+
+// Controls for a harness driving the simulation.
+
+// Simulated time since the start (us), how much of it every fiber spent asleep, and how much the device spent
+// going round loops that didn't touch the bus.
+uint64_t SimTime();
+uint64_t SimIdleTime();
+uint64_t SimSpinTime();
+
+// Lets a fiber spinning through SCHEDULE_UNTIL skip whole passes of its loop instead of paying for each one.
+// Only once two passes in a row took the same time and didn't touch the bus, and never up to the time it said
+// it next has something to do or another fiber wakes, so everything happens at the same time as it would have
+// without the skip. Off runs every pass.
+void SimSetSpinSkip(bool skip);
+
+// Marks the calling fiber as part of the simulation rather than the device (e.g. a simulated player), so
+// switching to it takes no simulated time.
+void SimMarkExternal();
+
+// Sleeps the calling fiber until the given time, or until the device writes a new value to port A or changes the
+// display.
+void SimSleepUntil(uint64_t time);
+
+// Port A values written by the device, oldest first, with when the write finished. Returns false once there
+// are none left. Only kept while SimWatchOutputs is on.
+bool SimTakeOutputChange(uint64_t * time, uint8_t * outputs);
+
+// The same for what was put on the display.
+bool SimTakeDisplayChange(uint64_t * time, ManagedString * shown);
+
+void SimWatchOutputs(bool watch);
+
+// Buttons on port B held down by the simulated player, as a mask of input pins.
+void SimSetButtons(uint8_t pressed);
+
+void SimSetButtonB(bool pressed);
+
+// Fits or removes the wire from port A pin 7 to port B pin 7 used by the loopback benchmark. Off to start with.
+void SimSetLoopbackWire(bool fitted);
+
+// Everything the device has sent over serial since the last clear.
+const std::string & SimSerialOutput();
+void SimClearSerial();
+
+// Queues characters to be read by the device.
+void SimSendSerial(const char * text);
+
+// Simulated flash. The pages near the end of the code space are backed, at the same addresses as on the device.
+uint8_t * SimFlashPage(uint32_t page);
+uint32_t SimFlashPageSize();
+
+// Moves the end of the program image (an address in flash). It starts below every simulated page.
+void SimSetProgramEnd(uint32_t address);
+
+// Cuts the power to the flash once this many more bytes have been written or erased, so nothing more changes.
+// Negative for no limit, which is how it starts.
+void SimSetFlashBudget(int64_t bytes);
+int64_t SimFlashBudget();
+// Bytes written or erased since the start, whether the budget allowed them or not.
+uint64_t SimFlashBytesChanged();
+
+#endif
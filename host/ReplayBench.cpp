@@ -0,0 +1,639 @@
+// Plays made up games through the real game code on the simulated micro:bit, with a simulated player pressing
+// the buttons, and reports the bus use, CPU time and how far the measured reaction times were from the ones
+// the player actually took. Everything runs on simulated time, so the results are the same on every run and
+// can be checked against stored baselines. Given a trace saved from the device, it replays that instead.
+#include "MicroBit.h"
+#include "GPIOManager.h"
+#include "InputTrace.h"
+#include "InputScheduler.h"
+#include "DisplayPresenter.h"
+#include "TraceFile.h"
+#include <stdio.h>
+#include <time.h>
+#include <vector>
+
+// From source/main.cpp.
+extern MicroBit uBit;
+extern GPIOManager IOManager;
+extern DisplayPresenter Presenter;
+extern InputScheduler Scheduler;
+extern InputTrace Trace;
+extern const SchedulerPolicy BusyPollPolicy;
+extern const SchedulerPolicy InterruptPolicy;
+extern const SchedulerPolicy PhasedPolicy;
+extern const SchedulerPolicy ThroughputPolicy;
+int RecordGame(int mode, int option, uint32_t seed, const SchedulerPolicy * policy);
+int ReplayTrace(const SchedulerPolicy * policy);
+void SynthesiseTrace(int mode, int option, uint32_t seed);
+void SendMetrics(int mode, int result);
+
+// Sessions run for each scenario unless the baselines say otherwise.
+#define BENCH_SESSIONS 50
+
+// How much worse than the baseline a figure can get before the check fails.
+#define BENCH_TOLERANCE_PERCENT 2
+#define BENCH_ERROR_TOLERANCE 50
+
+struct Scenario{
+    const char * Name;
+    int Mode;
+    int Option;
+    // The result is a winner, so a replay has to get exactly the same one. Otherwise it's a time or a count that
+    // moves with the replay's own timing error.
+    bool ExactResult;
+    // Input policy the game is recorded and replayed with, NULL for the one the mode normally uses.
+    const SchedulerPolicy * Policy;
+};
+
+// The last four play the same reaction games as REACTION under each input policy, to compare their bus use and
+// how late they see the presses.
+const Scenario Scenarios[] = {
+    {"REACTION", 1, 0, false, NULL},
+    {"COUNT", 2, 0, false, NULL},
+    {"VERSUS", 3, 0, true, NULL},
+    {"MULTI1", 4, 1, true, NULL},
+    {"MULTI2", 4, 2, true, NULL},
+    {"MULTI3", 4, 3, true, NULL},
+    {"MULTI4", 4, 4, true, NULL},
+    {"BUSYPOLL", 1, 0, false, &BusyPollPolicy},
+    {"INTERRUPT", 1, 0, false, &InterruptPolicy},
+    {"PHASED", 1, 0, false, &PhasedPolicy},
+    {"THROUGHPUT", 1, 0, false, &ThroughputPolicy}};
+
+#define SCENARIO_COUNT (int)(sizeof(Scenarios) / sizeof(Scenarios[0]))
+
+// Totals over every session of a scenario.
+struct ScenarioStats{
+    int64_t Results;
+    uint64_t Reads;
+    uint64_t Writes;
+    uint64_t BusyTime;
+    uint64_t Time;
+    uint64_t IdleTime;
+    uint64_t SpinTime;
+    // Time the input scheduler spent reading port B, and the time it was timing, over every phase.
+    uint64_t SampleBusyTime;
+    uint64_t SampleTime;
+    uint64_t Responses;
+    uint64_t TotalError;
+    uint64_t MaxError;
+    // Planned presses the game never measured. In Versus that includes the loser pressing after the winner.
+    uint64_t Missed;
+    // Sessions where replaying the recorded trace didn't give the same result, or didn't finish cleanly.
+    uint64_t Mismatched;
+    // How far each replay was from its recording, for each LED.
+    ReplayStats Replayed[8];
+};
+
+// Per session figures as kept in the baselines file.
+struct Baseline{
+    char Name[16];
+    long long Results;
+    unsigned long Reads;
+    unsigned long Writes;
+    unsigned long BusyTime;
+    unsigned long Cpu;
+    unsigned long Util;
+    unsigned long AvgError;
+    unsigned long MaxError;
+    unsigned long Missed;
+    unsigned long Mismatched;
+};
+
+struct PlannedPress{
+    uint64_t Down;
+    uint64_t Up;
+    // Which stimulus it answers, in the order they lit.
+    int Stimulus;
+    uint8_t LEDPin;
+    uint8_t InputPin;
+};
+
+// Watches the LEDs and presses the buttons after the delays in a trace, like a person would.
+struct SimPlayer{
+    InputTrace * Plan;
+    int Cursor;
+    uint8_t Lit;
+    // Countdowns seen so far. Early presses in the plan are timed from the start of their countdown.
+    int Window;
+    int PlannedEarly;
+    // Delay the player meant to take for each stimulus, in the order they lit.
+    std::vector<uint32_t> Planned;
+    std::vector<PlannedPress> Presses;
+};
+
+SimPlayer Player;
+
+// Queues a press of inputPin from down until it has been held for TRACE_HOLD_TIME.
+void PlanPress(uint64_t down, int stimulus, uint8_t ledPin, uint8_t inputPin)
+{
+    PlannedPress press;
+    press.Down = down;
+    press.Up = down + TRACE_HOLD_TIME;
+    press.Stimulus = stimulus;
+    press.LEDPin = ledPin;
+    press.InputPin = inputPin;
+    Player.Presses.push_back(press);
+}
+
+void PlayerFiber(void * param)
+{
+    (void)param;
+    SimMarkExternal();
+
+    while (1)
+    {
+        uint64_t time;
+        ManagedString shown;
+        while (SimTakeDisplayChange(&time, &shown))
+        {
+            // A countdown starting, anyone planning to jump the start presses partway through it.
+            if (Player.Plan == NULL || !(shown == ManagedString("3")))
+            {
+                continue;
+            }
+
+            Player.Window++;
+            for (int i = 0; i < Player.Plan->GetLength(); i++)
+            {
+                TraceEvent * event = Player.Plan->GetEvent(i);
+                if (event->LEDPin == TRACE_EARLY_PIN && event->Window == Player.Window)
+                {
+                    PlanPress(time + event->Delay, -1, TRACE_EARLY_PIN, event->InputPin);
+                    Player.PlannedEarly++;
+                }
+            }
+        }
+
+        uint8_t outputs;
+        while (SimTakeOutputChange(&time, &outputs))
+        {
+            uint8_t rising = outputs & ~Player.Lit;
+            uint8_t falling = Player.Lit & ~outputs;
+            Player.Lit = outputs;
+
+            if (Player.Plan == NULL)
+            {
+                continue;
+            }
+
+            // Nobody presses a button after its LED has gone out (e.g. the other player won).
+            for (size_t i = 0; i < Player.Presses.size(); i++)
+            {
+                PlannedPress & press = Player.Presses[i];
+                if (press.Stimulus >= 0 && (falling & (1 << press.LEDPin)) && press.Down > time)
+                {
+                    press.Up = 0;
+                    Player.Planned[press.Stimulus] = TRACE_NO_RESPONSE;
+                }
+            }
+
+            // LEDs that light in the same write are taken lowest first, the same as GPIOManager.
+            for (int led = 0; led < 8; led++)
+            {
+                while (Player.Cursor < Player.Plan->GetLength() &&
+                       Player.Plan->GetEvent(Player.Cursor)->LEDPin == TRACE_EARLY_PIN)
+                {
+                    Player.Cursor++;
+                }
+                if (!(rising & (1 << led)) || Player.Cursor >= Player.Plan->GetLength())
+                {
+                    continue;
+                }
+
+                TraceEvent * event = Player.Plan->GetEvent(Player.Cursor++);
+                Player.Planned.push_back(event->Delay);
+                if (event->Delay == TRACE_NO_RESPONSE)
+                {
+                    continue;
+                }
+
+                PlanPress(time + event->Delay, Player.Planned.size() - 1, led,
+                          event->InputPin == TRACE_ANY_PIN ? Player.Plan->GetPairing(led) : event->InputPin);
+            }
+        }
+
+        // Hold everything between its press and release, and sleep until the next change.
+        uint64_t now = SimTime();
+        uint64_t next = UINT64_MAX;
+        uint8_t held = 0;
+        std::vector<PlannedPress> pending;
+
+        for (size_t i = 0; i < Player.Presses.size(); i++)
+        {
+            PlannedPress & press = Player.Presses[i];
+            if (press.Up <= now)
+            {
+                continue;
+            }
+
+            if (press.Down <= now)
+            {
+                held |= 1 << press.InputPin;
+                next = press.Up < next ? press.Up : next;
+            }
+            else
+            {
+                next = press.Down < next ? press.Down : next;
+            }
+            pending.push_back(press);
+        }
+
+        Player.Presses.swap(pending);
+        SimSetButtons(held);
+        SimSleepUntil(next);
+    }
+}
+
+double WallTime()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void RunSession(const Scenario & scenario, uint32_t seed, ScenarioStats * stats)
+{
+    // The made up game becomes the player's plan, and the game records what it measured over the top.
+    SynthesiseTrace(scenario.Mode, scenario.Option, seed);
+    InputTrace plan = Trace;
+
+    Player.Plan = &plan;
+    Player.Cursor = 0;
+    Player.Window = -1;
+    Player.PlannedEarly = 0;
+    Player.Planned.clear();
+    Player.Presses.clear();
+
+    uint64_t start = SimTime();
+    uint64_t idleStart = SimIdleTime();
+    uint64_t spinStart = SimSpinTime();
+
+    int result = RecordGame(scenario.Mode, scenario.Option, seed, scenario.Policy);
+
+    stats->Time += SimTime() - start;
+    stats->IdleTime += SimIdleTime() - idleStart;
+    stats->SpinTime += SimSpinTime() - spinStart;
+    Player.Plan = NULL;
+
+    BusStats bus = IOManager.GetBusStats();
+    stats->Results += result;
+    stats->Reads += bus.Reads;
+    stats->Writes += bus.Writes;
+    stats->BusyTime += bus.BusyTime;
+
+    for (int phase = 0; phase < PhaseCount; phase++)
+    {
+        PhaseStats sampling = Scheduler.GetStats((InputPhase)phase);
+        stats->SampleBusyTime += sampling.BusyTime;
+        stats->SampleTime += sampling.Time;
+    }
+
+    // Both are in the order the LEDs lit, so the stimuli pair up one for one.
+    int stimulus = 0;
+    int early = 0;
+    for (int i = 0; i < Trace.GetLength(); i++)
+    {
+        if (Trace.GetEvent(i)->LEDPin == TRACE_EARLY_PIN)
+        {
+            early++;
+            continue;
+        }
+        if (stimulus >= (int)Player.Planned.size())
+        {
+            continue;
+        }
+
+        uint32_t planned = Player.Planned[stimulus++];
+        uint32_t measured = Trace.GetEvent(i)->Delay;
+        if (planned == TRACE_NO_RESPONSE)
+        {
+            continue;
+        }
+        if (measured == TRACE_NO_RESPONSE)
+        {
+            stats->Missed++;
+            continue;
+        }
+
+        uint32_t error = measured > planned ? measured - planned : planned - measured;
+        stats->Responses++;
+        stats->TotalError += error;
+        if (error > stats->MaxError)
+        {
+            stats->MaxError = error;
+        }
+    }
+
+    // Every jump start the player made should have been caught.
+    if (early < Player.PlannedEarly)
+    {
+        stats->Missed += Player.PlannedEarly - early;
+    }
+
+    // Let the results finish on the display so the next game starts from the same place.
+    Presenter.WaitUntilIdle(&Scheduler);
+
+    // The recording on its own, with nobody at the buttons, has to play out the same game.
+    int replayed = ReplayTrace(scenario.Policy);
+    ReplayStatus status = IOManager.GetReplayStatus();
+    for (int led = 0; led < 8; led++)
+    {
+        ReplayStats replay = IOManager.GetReplayStats(led);
+        stats->Replayed[led].Responses += replay.Responses;
+        stats->Replayed[led].TotalError += replay.TotalError;
+        if (replay.MaxError > stats->Replayed[led].MaxError)
+        {
+            stats->Replayed[led].MaxError = replay.MaxError;
+        }
+    }
+    if ((scenario.ExactResult && replayed != result) || (status != ReplayOK && status != ReplayEnded))
+    {
+        stats->Mismatched++;
+    }
+    Presenter.WaitUntilIdle(&Scheduler);
+}
+
+// Replays a trace saved from the device, on its own, and prints the metrics the device would send after it.
+// Returns 0 if the replay played out cleanly, with every LED's responses measured to within the budget.
+int ReplayFile(const char * path)
+{
+    // Made up events in the dump press whichever button goes with their LED, the same as in a made up game.
+    SynthesiseTrace(1, 0, 0);
+    if (!LoadTrace(path, &Trace))
+    {
+        fprintf(stderr, "Can't read a trace from %s\n", path);
+        return 2;
+    }
+
+    SimClearSerial();
+    int result = ReplayTrace(NULL);
+    SendMetrics(Trace.GetGameMode(), result);
+    Presenter.WaitUntilIdle(&Scheduler);
+
+    const std::string & output = SimSerialOutput();
+    for (size_t i = 0; i < output.length(); i++)
+    {
+        if (output[i] != '\r')
+        {
+            putchar(output[i]);
+        }
+    }
+
+    bool ok = true;
+    for (int led = 0; led < 8; led++)
+    {
+        ok &= IOManager.GetReplayStats(led).MaxError <= REPLAY_ERROR_BUDGET;
+    }
+
+    ReplayStatus status = IOManager.GetReplayStatus();
+    return ok && (status == ReplayOK || status == ReplayEnded) ? 0 : 1;
+}
+
+// Prints how far the replays were from their recordings for each LED, i.e. each player in a multi player game.
+// Returns false if any of them went over the budget.
+bool CheckPlayers(const char * name, const ScenarioStats & stats)
+{
+    bool ok = true;
+
+    for (int led = 0; led < 8; led++)
+    {
+        const ReplayStats & replay = stats.Replayed[led];
+        if (replay.Responses == 0)
+        {
+            continue;
+        }
+
+        bool within = replay.MaxError <= REPLAY_ERROR_BUDGET;
+        printf("%-10s LED:%d N:%u AVGERR(us):%u MAXERR(us):%u %s\n", name, led, replay.Responses,
+               replay.TotalError / replay.Responses, replay.MaxError, within ? "OK" : "OVER");
+        ok &= within;
+    }
+
+    return ok;
+}
+
+Baseline Summarise(const char * name, const ScenarioStats & stats, int sessions)
+{
+    Baseline b;
+    snprintf(b.Name, sizeof(b.Name), "%s", name);
+    b.Results = stats.Results;
+    b.Reads = stats.Reads / sessions;
+    b.Writes = stats.Writes / sessions;
+    b.BusyTime = stats.BusyTime / sessions;
+    // Tenths of a percent of the game's time the CPU was doing something, rather than asleep or going round a
+    // loop that didn't touch the bus.
+    b.Cpu = stats.Time ? (stats.Time - stats.IdleTime - stats.SpinTime) * 1000 / stats.Time : 0;
+    // The same for the bus time spent sampling the inputs, as the scheduler sends it as UTIL.
+    b.Util = stats.SampleTime ? stats.SampleBusyTime * 1000 / stats.SampleTime : 0;
+    b.AvgError = stats.Responses ? stats.TotalError / stats.Responses : 0;
+    b.MaxError = stats.MaxError;
+    b.Missed = stats.Missed;
+    b.Mismatched = stats.Mismatched;
+    return b;
+}
+
+void PrintBaseline(FILE * file, const Baseline & b)
+{
+    fprintf(file, "%s %lld %lu %lu %lu %lu %lu %lu %lu %lu %lu\n", b.Name, b.Results, b.Reads, b.Writes, b.BusyTime, b.Cpu,
+            b.Util, b.AvgError, b.MaxError, b.Missed, b.Mismatched);
+}
+
+// Returns true if the figure is no worse than the baseline allows.
+bool Within(const char * name, const char * figure, unsigned long value, unsigned long baseline, unsigned long allowed)
+{
+    if (value <= baseline + allowed)
+    {
+        return true;
+    }
+
+    printf("REGRESSED %s %s:%lu BASELINE:%lu\n", name, figure, value, baseline);
+    return false;
+}
+
+bool Check(const Baseline & b, const Baseline & expected)
+{
+    bool ok = true;
+
+    if (b.Results != expected.Results)
+    {
+        printf("CHANGED %s RESULTS:%lld BASELINE:%lld\n", b.Name, b.Results, expected.Results);
+        ok = false;
+    }
+
+    ok &= Within(b.Name, "READS", b.Reads, expected.Reads, expected.Reads * BENCH_TOLERANCE_PERCENT / 100 + 1);
+    ok &= Within(b.Name, "WRITES", b.Writes, expected.Writes, expected.Writes * BENCH_TOLERANCE_PERCENT / 100 + 1);
+    ok &= Within(b.Name, "BUSY", b.BusyTime, expected.BusyTime, expected.BusyTime * BENCH_TOLERANCE_PERCENT / 100 + 1);
+    ok &= Within(b.Name, "CPU", b.Cpu, expected.Cpu, expected.Cpu * BENCH_TOLERANCE_PERCENT / 100 + 1);
+    ok &= Within(b.Name, "UTIL", b.Util, expected.Util, expected.Util * BENCH_TOLERANCE_PERCENT / 100 + 1);
+    ok &= Within(b.Name, "AVGERR", b.AvgError, expected.AvgError, BENCH_ERROR_TOLERANCE);
+    ok &= Within(b.Name, "MAXERR", b.MaxError, expected.MaxError, BENCH_ERROR_TOLERANCE);
+    ok &= Within(b.Name, "MISSED", b.Missed, expected.Missed, 0);
+
+    // A replay has to play out the same game whatever the baseline says.
+    if (b.Mismatched != 0)
+    {
+        printf("MISMATCHED %s SESSIONS:%lu\n", b.Name, b.Mismatched);
+        ok = false;
+    }
+
+    return ok;
+}
+
+// Reads a baselines file, the first line is the number of sessions each scenario was run for.
+int LoadBaselines(const char * path, std::vector<Baseline> * baselines)
+{
+    FILE * file = fopen(path, "r");
+    if (file == NULL)
+    {
+        return -1;
+    }
+
+    int sessions = 0;
+    if (fscanf(file, "SESSIONS %d", &sessions) != 1)
+    {
+        fclose(file);
+        return -1;
+    }
+
+    Baseline b;
+    while (fscanf(file, "%15s %lld %lu %lu %lu %lu %lu %lu %lu %lu %lu", b.Name, &b.Results, &b.Reads, &b.Writes, &b.BusyTime,
+                  &b.Cpu, &b.Util, &b.AvgError, &b.MaxError, &b.Missed, &b.Mismatched) == 11)
+    {
+        baselines->push_back(b);
+    }
+
+    fclose(file);
+    return sessions;
+}
+
+int main(int argc, char ** argv)
+{
+    int sessions = BENCH_SESSIONS;
+    bool spinSkip = true;
+    const char * checkPath = NULL;
+    const char * writePath = NULL;
+    const char * tracePath = NULL;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--sessions") == 0 && i + 1 < argc)
+        {
+            sessions = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--exact") == 0)
+        {
+            spinSkip = false;
+        }
+        else if (strcmp(argv[i], "--check") == 0 && i + 1 < argc)
+        {
+            checkPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--write") == 0 && i + 1 < argc)
+        {
+            writePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+        {
+            tracePath = argv[++i];
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [--sessions N] [--exact] [--check FILE] [--write FILE] [--trace FILE]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    std::vector<Baseline> baselines;
+    if (checkPath != NULL)
+    {
+        sessions = LoadBaselines(checkPath, &baselines);
+        if (sessions <= 0)
+        {
+            fprintf(stderr, "Can't read baselines from %s\n", checkPath);
+            return 2;
+        }
+    }
+
+    uBit.init();
+    IOManager.Init(&uBit);
+    Presenter.Init(&uBit);
+    Scheduler.Init(&IOManager);
+
+    SimSetSpinSkip(spinSkip);
+    SimWatchOutputs(true);
+    create_fiber(PlayerFiber, NULL);
+
+    if (tracePath != NULL)
+    {
+        return ReplayFile(tracePath);
+    }
+
+    FILE * out = writePath != NULL ? fopen(writePath, "w") : NULL;
+    if (out != NULL)
+    {
+        fprintf(out, "SESSIONS %d\n", sessions);
+    }
+
+    bool ok = true;
+    int total = 0;
+    double wallStart = WallTime();
+
+    for (int s = 0; s < SCENARIO_COUNT; s++)
+    {
+        ScenarioStats stats;
+        memset(&stats, 0, sizeof(stats));
+
+        double scenarioStart = WallTime();
+        for (int i = 0; i < sessions; i++)
+        {
+            RunSession(Scenarios[s], i + 1, &stats);
+        }
+        double wall = WallTime() - scenarioStart;
+        total += sessions;
+
+        Baseline b = Summarise(Scenarios[s].Name, stats, sessions);
+        printf("%-10s RESULTS:%lld READS:%lu WRITES:%lu BUSY(us):%lu CPU(0.1%%):%lu UTIL(0.1%%):%lu AVGERR(us):%lu MAXERR(us):%lu MISSED:%lu MISMATCHED:%lu SESSIONS/S:%.0f\n",
+               b.Name, b.Results, b.Reads, b.Writes, b.BusyTime, b.Cpu, b.Util, b.AvgError, b.MaxError, b.Missed,
+               b.Mismatched, sessions / wall);
+
+        // Every player in a multi player game has to be timed to within the budget.
+        if (Scenarios[s].Mode == 4)
+        {
+            ok &= CheckPlayers(b.Name, stats);
+        }
+
+        if (out != NULL)
+        {
+            PrintBaseline(out, b);
+        }
+
+        if (checkPath != NULL)
+        {
+            bool found = false;
+            for (size_t j = 0; j < baselines.size(); j++)
+            {
+                if (strcmp(baselines[j].Name, b.Name) == 0)
+                {
+                    ok &= Check(b, baselines[j]);
+                    found = true;
+                }
+            }
+            if (!found)
+            {
+                printf("MISSING %s has no baseline\n", b.Name);
+                ok = false;
+            }
+        }
+    }
+
+    double wall = WallTime() - wallStart;
+    printf("TOTAL SESSIONS:%d TIME(s):%.2f SESSIONS/S:%.0f\n", total, wall, total / wall);
+
+    if (out != NULL)
+    {
+        fclose(out);
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,837 @@
+#include "MicroBit.h"
+#include <ucontext.h>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <deque>
+#include <vector>
+
+// What the device spends time on (us). These are rough figures for a 16MHz nRF51 running the runtime.
+#define SIM_TICKER_COST 2
+#define SIM_PIN_COST 2
+#define SIM_SCHEDULE_COST 4
+#define SIM_SWITCH_COST 20
+#define SIM_SERIAL_COST 5
+
+// 100kHz i2c, 9 bit times per byte including the ack, plus the start and stop.
+#define SIM_I2C_BYTE_TIME 90
+#define SIM_I2C_OVERHEAD 20
+
+// Writes are 8 bit addresses, the expander has all its address pins low.
+#define SIM_EXPANDER_ADDRESS 0x40
+
+// Flash timings from the nRF51 datasheet.
+#define SIM_FLASH_ERASE_TIME 22300
+#define SIM_FLASH_WORD_TIME 46
+
+// Pages backed at the end of the code space.
+#define SIM_FLASH_PAGES 32
+
+#define SIM_FIBER_STACK (256 * 1024)
+
+#define SIM_SERIAL_LIMIT (1024 * 1024)
+
+// Registers of one port, in the order the MCP23017 lays them out.
+enum ExpanderRegister{
+    RegIODIR,
+    RegIPOL,
+    RegGPINTEN,
+    RegDEFVAL,
+    RegINTCON,
+    RegIOCON,
+    RegGPPU,
+    RegINTF,
+    RegINTCAP,
+    RegGPIO,
+    RegOLAT,
+    RegCount
+};
+
+// IOCON bits.
+#define IOCON_BANK 0x80
+#define IOCON_SEQOP 0x20
+#define IOCON_INTPOL 0x02
+
+struct Fiber{
+    // Only used to get a new fiber onto its own stack, switches after that are done with Jump. swapcontext
+    // saves the signal mask each time, which costs a system call.
+    ucontext_t Context;
+    jmp_buf Jump;
+    bool Started;
+    // The fiber can run once the time reaches this.
+    uint64_t Wake;
+    bool WakeOnOutputs;
+    bool External;
+    void (*Entry)(void *);
+    void * Param;
+    // Bus activity count and time the last time the fiber went through the scheduler, and how long the pass
+    // before that took if it didn't touch the bus (zero otherwise).
+    uint64_t Activity;
+    uint64_t PassStart;
+    uint64_t PassCost;
+};
+
+static uint64_t Now = 0;
+static uint64_t Idle = 0;
+static uint64_t Spin = 0;
+static bool SpinSkip = false;
+static uint64_t Activity = 0;
+
+static Fiber MainFiber = Fiber();
+static Fiber * Current = &MainFiber;
+static size_t CurrentIndex = 0;
+
+static std::vector<Fiber *> & Fibers(){
+    static std::vector<Fiber *> fibers(1, &MainFiber);
+    // The main fiber is already running, so it's resumed from where it switched away rather than started.
+    MainFiber.Started = true;
+    return fibers;
+}
+
+static uint8_t Registers[2][RegCount];
+static uint8_t Pointer = 0;
+static uint8_t Pressed = 0;
+// Pin levels on port B the last time anything changed, for the interrupt on change.
+static uint8_t PortBLevels = 0xFF;
+static bool Interrupt = false;
+
+static bool WatchOutputs = false;
+static std::deque<std::pair<uint64_t, uint8_t> > OutputChanges;
+static std::deque<std::pair<uint64_t, ManagedString> > DisplayChanges;
+
+static std::string SerialOutput;
+static std::deque<char> SerialInput;
+
+static bool ButtonBPressed = false;
+static bool LoopbackWire = false;
+
+static int64_t FlashBudget = -1;
+static uint64_t FlashBytesChanged = 0;
+
+static NRF_FICR_Type Ficr = {1024, 256};
+NRF_FICR_Type * NRF_FICR = &Ficr;
+
+// Well short of the end of the code space, like a small program.
+static uint32_t ProgramEnd = 64 * 1024;
+
+static void Spend(uint32_t time){
+    // The simulation's own fibers don't use any of the device's time.
+    if (!Current->External)
+        Now += time;
+}
+
+static void SwitchTo(size_t index){
+    Fiber * from = Current;
+    Fiber * to = Fibers()[index];
+
+    if (!from->External && !to->External)
+        Now += SIM_SWITCH_COST;
+
+    Current = to;
+    CurrentIndex = index;
+
+    if (_setjmp(from->Jump) == 0){
+        if (to->Started)
+            _longjmp(to->Jump, 1);
+
+        to->Started = true;
+        setcontext(&to->Context);
+    }
+}
+
+// Finds the next fiber after the current one that can run, going round in order. Returns -1 if there isn't one.
+static int NextRunnable(bool includeCurrent){
+    std::vector<Fiber *> & fibers = Fibers();
+
+    for (size_t i = 1; i <= fibers.size(); i++){
+        size_t index = (CurrentIndex + i) % fibers.size();
+        if (index == CurrentIndex && !includeCurrent)
+            continue;
+        if (fibers[index]->Wake <= Now)
+            return (int)index;
+    }
+    return -1;
+}
+
+static uint64_t NextWake(bool includeCurrent){
+    uint64_t wake = UINT64_MAX;
+
+    for (size_t i = 0; i < Fibers().size(); i++){
+        if (i == CurrentIndex && !includeCurrent)
+            continue;
+        if (Fibers()[i]->Wake < wake)
+            wake = Fibers()[i]->Wake;
+    }
+    return wake;
+}
+
+// Starts timing the calling fiber's next pass through its loop.
+static void StartPass(uint64_t lastCost){
+    Current->Activity = Activity;
+    Current->PassStart = Now;
+    Current->PassCost = lastCost;
+}
+
+// The device fiber that ran the externals in RunExternals, -1 when they weren't run from there.
+static int ExternalCaller = -1;
+
+// Externals (the simulated player) act at their own times, not whenever the device next yields. Runs any that
+// are due, before the device looks at anything they drive.
+static void RunExternals(){
+    if (Current->External)
+        return;
+
+    for (size_t i = 0; i < Fibers().size(); i++){
+        if (Fibers()[i]->External && Fibers()[i]->Wake <= Now){
+            ExternalCaller = (int)CurrentIndex;
+            SwitchTo(i);
+        }
+    }
+}
+
+static void Sleep(uint64_t wake, bool wakeOnOutputs){
+    Current->Wake = wake;
+    Current->WakeOnOutputs = wakeOnOutputs;
+
+    while (Current->Wake > Now){
+        // Run from inside a device call, so straight back to it.
+        if (Current->External && ExternalCaller >= 0){
+            size_t caller = ExternalCaller;
+            ExternalCaller = -1;
+            SwitchTo(caller);
+            continue;
+        }
+
+        int next = NextRunnable(false);
+        if (next >= 0){
+            // Whoever switches back only does so once this fiber can run.
+            SwitchTo(next);
+            continue;
+        }
+
+        // Everything is asleep, jump to whoever wakes first.
+        uint64_t first = NextWake(true);
+        if (first == UINT64_MAX){
+            fprintf(stderr, "Every fiber is asleep for good\n");
+            abort();
+        }
+        Idle += first - Now;
+        Now = first;
+    }
+
+    Current->WakeOnOutputs = false;
+    StartPass(0);
+}
+
+static void FiberStart(){
+    Current->Entry(Current->Param);
+    release_fiber();
+}
+
+uint32_t us_ticker_read(){
+    Spend(SIM_TICKER_COST);
+    return (uint32_t)Now;
+}
+
+void wait_ms(int ms){
+    fiber_sleep(ms);
+}
+
+void fiber_sleep(unsigned long t){
+    Sleep(Now + (uint64_t)t * 1000, false);
+}
+
+// Hands over to another fiber if one can run. Otherwise the caller is spinning, and until (zero if it didn't
+// say) is when it next has anything to do.
+static void Yield(uint64_t until){
+    Spend(SIM_SCHEDULE_COST);
+
+    int next = NextRunnable(false);
+    if (next >= 0){
+        SwitchTo(next);
+        StartPass(0);
+        return;
+    }
+
+    uint64_t cost = Now - Current->PassStart;
+    bool quiet = Current->Activity == Activity;
+    if (quiet)
+        Spin += cost;
+
+    // A pass that didn't touch the bus and took the same time as the one before is the loop going round with
+    // nothing to do, and it keeps doing the same until it reads a time at or past until, or another fiber
+    // runs. Passes that finish before either can be skipped without anything happening any differently.
+    if (SpinSkip && quiet && cost > 0 && cost == Current->PassCost && until > Now){
+        uint64_t passes = (until - Now) / cost;
+        uint64_t wake = NextWake(false);
+        if (wake != UINT64_MAX && (wake - 1 - Now) / cost < passes)
+            passes = (wake - 1 - Now) / cost;
+
+        Now += passes * cost;
+        Spin += passes * cost;
+    }
+
+    StartPass(quiet ? cost : 0);
+}
+
+void schedule(){
+    Yield(0);
+}
+
+void schedule_until(uint32_t time){
+    // The clock the device sees is the bottom 32 bits of the simulated one.
+    int32_t ahead = (int32_t)(time - (uint32_t)Now);
+    Yield(ahead > 0 ? Now + ahead : 0);
+}
+
+Fiber * create_fiber(void (*entry_fn)(void *), void * param){
+    Fiber * fiber = new Fiber();
+    fiber->Wake = Now;
+    fiber->WakeOnOutputs = false;
+    fiber->External = false;
+    fiber->Entry = entry_fn;
+    fiber->Param = param;
+    fiber->Activity = 0;
+    fiber->PassStart = 0;
+    fiber->PassCost = 0;
+    fiber->Started = false;
+
+    getcontext(&fiber->Context);
+    fiber->Context.uc_stack.ss_sp = malloc(SIM_FIBER_STACK);
+    fiber->Context.uc_stack.ss_size = SIM_FIBER_STACK;
+    fiber->Context.uc_link = NULL;
+    makecontext(&fiber->Context, FiberStart, 0);
+
+    Fibers().push_back(fiber);
+    return fiber;
+}
+
+void release_fiber(){
+    Sleep(UINT64_MAX, false);
+}
+
+int itoa(int n, char * s){
+    sprintf(s, "%d", n);
+    return MICROBIT_OK;
+}
+
+// Wakes anything sleeping in SimSleepUntil.
+static void WakeWatchers(){
+    for (size_t i = 0; i < Fibers().size(); i++){
+        if (Fibers()[i]->WakeOnOutputs)
+            Fibers()[i]->Wake = Now;
+    }
+}
+
+// Display, nothing is drawn but the last thing shown is kept.
+
+static void Show(ManagedString * shown, ManagedString s){
+    *shown = s;
+
+    if (WatchOutputs){
+        DisplayChanges.push_back(std::make_pair(Now, s));
+        WakeWatchers();
+    }
+}
+
+int MicroBitDisplay::print(char c, int delay){
+    (void)delay;
+    Show(&Shown, ManagedString(c));
+    return MICROBIT_OK;
+}
+
+int MicroBitDisplay::print(ManagedString s, int delay){
+    (void)delay;
+    Show(&Shown, s);
+    return MICROBIT_OK;
+}
+
+int MicroBitDisplay::print(MicroBitImage image, int x, int y, int alpha, int delay){
+    (void)x;
+    (void)y;
+    (void)alpha;
+    (void)delay;
+    Show(&Shown, ManagedString(image.Glyph));
+    return MICROBIT_OK;
+}
+
+int MicroBitDisplay::scrollAsync(ManagedString s, int delay){
+    (void)delay;
+    Show(&Shown, s);
+    return MICROBIT_OK;
+}
+
+int MicroBitDisplay::scrollAsync(int number, int delay){
+    return scrollAsync(ManagedString(number), delay);
+}
+
+void MicroBitDisplay::stopAnimation(){
+}
+
+void MicroBitDisplay::clear(){
+    Show(&Shown, ManagedString());
+}
+
+// Serial
+
+int MicroBitSerial::send(ManagedString s, MicroBitSerialMode mode){
+    (void)mode;
+    Spend(SIM_SERIAL_COST);
+
+    if (SerialOutput.length() < SIM_SERIAL_LIMIT)
+        SerialOutput += s.toCharArray();
+
+    return s.length();
+}
+
+int MicroBitSerial::read(MicroBitSerialMode mode){
+    (void)mode;
+    if (SerialInput.empty())
+        return MICROBIT_NO_DATA;
+
+    char c = SerialInput.front();
+    SerialInput.pop_front();
+    return c;
+}
+
+// Expander
+
+static bool ExpanderBank1(){
+    return Registers[0][RegIOCON] & IOCON_BANK;
+}
+
+static void DecodeAddress(uint8_t address, int * port, int * reg){
+    if (ExpanderBank1()){
+        *port = (address >> 4) & 0x01;
+        *reg = address & 0x0F;
+    }else{
+        *port = address & 0x01;
+        *reg = address >> 1;
+    }
+}
+
+// Buttons pull their pin low, everything else is pulled up. Port A pin 7 can be wired to port B pin 7 for the
+// loopback benchmark.
+static uint8_t ReadPortBLevels(){
+    uint8_t levels = 0xFF & ~Pressed;
+
+    if (LoopbackWire && !(Registers[0][RegOLAT] & 0x80))
+        levels &= ~0x80;
+
+    return levels;
+}
+
+static void UpdateInterrupt(){
+    uint8_t levels = ReadPortBLevels();
+
+    // Interrupt on change, latched until port B is read.
+    if ((levels ^ PortBLevels) & Registers[1][RegGPINTEN])
+        Interrupt = true;
+
+    PortBLevels = levels;
+}
+
+static uint8_t ReadExpander(int port, int reg){
+    if (reg != RegGPIO && reg != RegINTCAP)
+        return reg < RegCount ? Registers[port][reg] : 0;
+
+    uint8_t levels = port ? ReadPortBLevels() : Registers[0][RegOLAT];
+    uint8_t inputs = Registers[port][RegIODIR];
+    uint8_t value = ((levels ^ Registers[port][RegIPOL]) & inputs) | (Registers[port][RegOLAT] & ~inputs);
+
+    if (port == 1)
+        Interrupt = false;
+
+    return value;
+}
+
+static void WriteExpander(int port, int reg, uint8_t value){
+    if (reg >= RegCount)
+        return;
+
+    if (reg == RegIOCON){
+        // Both ports share the one IOCON.
+        Registers[0][RegIOCON] = value;
+        Registers[1][RegIOCON] = value;
+        return;
+    }
+
+    if (reg == RegGPIO)
+        reg = RegOLAT;
+
+    uint8_t old = Registers[port][reg];
+    Registers[port][reg] = value;
+
+    if (port == 0 && reg == RegOLAT && old != value){
+        if (WatchOutputs)
+            OutputChanges.push_back(std::make_pair(Now, value));
+
+        WakeWatchers();
+    }
+
+    UpdateInterrupt();
+}
+
+static void ResetExpander(){
+    for (int port = 0; port < 2; port++){
+        for (int reg = 0; reg < RegCount; reg++){
+            Registers[port][reg] = reg == RegIODIR ? 0xFF : 0x00;
+        }
+    }
+    PortBLevels = ReadPortBLevels();
+}
+
+static struct ExpanderPowerOn{
+    ExpanderPowerOn() { ResetExpander(); }
+} ExpanderPowerOn;
+
+int MicroBitI2C::write(int address, const char * data, int length, bool repeated){
+    (void)repeated;
+    Activity++;
+
+    if (address != SIM_EXPANDER_ADDRESS){
+        Spend(SIM_I2C_BYTE_TIME + SIM_I2C_OVERHEAD);
+        return MICROBIT_I2C_ERROR;
+    }
+
+    // The write lands once the last byte is through.
+    Spend((length + 1) * SIM_I2C_BYTE_TIME + SIM_I2C_OVERHEAD);
+
+    if (length < 1)
+        return MICROBIT_OK;
+
+    Pointer = data[0];
+    for (int i = 1; i < length; i++){
+        int port, reg;
+        DecodeAddress(Pointer, &port, &reg);
+        WriteExpander(port, reg, data[i]);
+
+        if (!(Registers[0][RegIOCON] & IOCON_SEQOP))
+            Pointer++;
+    }
+
+    return MICROBIT_OK;
+}
+
+int MicroBitI2C::read(int address, char * data, int length, bool repeated){
+    (void)repeated;
+    Activity++;
+
+    if (address != SIM_EXPANDER_ADDRESS){
+        Spend(SIM_I2C_BYTE_TIME + SIM_I2C_OVERHEAD);
+        return MICROBIT_I2C_ERROR;
+    }
+
+    // The pins are sampled as the byte starts coming back.
+    Spend(SIM_I2C_BYTE_TIME + SIM_I2C_OVERHEAD);
+    RunExternals();
+
+    for (int i = 0; i < length; i++){
+        int port, reg;
+        DecodeAddress(Pointer, &port, &reg);
+        data[i] = ReadExpander(port, reg);
+
+        if (!(Registers[0][RegIOCON] & IOCON_SEQOP))
+            Pointer++;
+    }
+
+    Spend(length * SIM_I2C_BYTE_TIME);
+
+    return MICROBIT_OK;
+}
+
+int MicroBitPin::getDigitalValue(){
+    Spend(SIM_PIN_COST);
+
+    // Only the expander's interrupt is connected.
+    if (Name != 8)
+        return 0;
+
+    RunExternals();
+
+    bool activeHigh = Registers[0][RegIOCON] & IOCON_INTPOL;
+    return Interrupt == activeHigh;
+}
+
+int MicroBitButton::isPressed(){
+    return Id == 2 && ButtonBPressed;
+}
+
+// Flash
+
+static uint8_t * FlashBase(){
+    static uint8_t * base = NULL;
+
+    if (base == NULL){
+        uint32_t size = SIM_FLASH_PAGES * NRF_FICR->CODEPAGESIZE;
+        uintptr_t address = (uintptr_t)(NRF_FICR->CODESIZE - SIM_FLASH_PAGES) * NRF_FICR->CODEPAGESIZE;
+
+        // Mapped at the device's addresses, so code that works out a page's address itself still finds it.
+        void * mapped = mmap((void *)address, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        if (mapped != (void *)address){
+            fprintf(stderr, "Can't map the simulated flash at 0x%lx\n", (unsigned long)address);
+            abort();
+        }
+
+        base = (uint8_t *)mapped;
+        memset(base, 0xFF, size);
+    }
+
+    return base;
+}
+
+// The device reads the flash straight from its addresses, so it has to be there from the start.
+static struct FlashPowerOn{
+    FlashPowerOn() { FlashBase(); }
+} FlashPowerOn;
+
+uint8_t * SimFlashPage(uint32_t page){
+    uint32_t first = NRF_FICR->CODESIZE - SIM_FLASH_PAGES;
+    if (page < first || page >= NRF_FICR->CODESIZE){
+        fprintf(stderr, "Flash page %u isn't simulated\n", page);
+        abort();
+    }
+
+    return FlashBase() + (page - first) * NRF_FICR->CODEPAGESIZE;
+}
+
+uint32_t SimFlashPageSize(){
+    return NRF_FICR->CODEPAGESIZE;
+}
+
+uint32_t program_image_end(){
+    return ProgramEnd;
+}
+
+void SimSetProgramEnd(uint32_t address){
+    ProgramEnd = address;
+}
+
+// Changes one byte of flash, unless the power has gone.
+static void FlashByte(uint8_t * address, uint8_t value){
+    FlashBytesChanged++;
+    if (FlashBudget == 0)
+        return;
+    if (FlashBudget > 0)
+        FlashBudget--;
+
+    *address = value;
+}
+
+void MicroBitStorage::flashPageErase(uint32_t * page_address){
+    uint8_t * page = (uint8_t *)page_address;
+
+    Spend(SIM_FLASH_ERASE_TIME);
+    for (uint32_t i = 0; i < NRF_FICR->CODEPAGESIZE; i++){
+        FlashByte(page + i, 0xFF);
+    }
+}
+
+// Programming can only clear bits, the same as the real flash.
+void MicroBitStorage::flashWordWrite(uint32_t * address, uint32_t value){
+    uint8_t * bytes = (uint8_t *)address;
+    uint8_t data[4];
+    memcpy(data, &value, sizeof(data));
+
+    Spend(SIM_FLASH_WORD_TIME);
+    for (int i = 0; i < 4; i++){
+        FlashByte(bytes + i, bytes[i] & data[i]);
+    }
+}
+
+// Storage, laid out like MicroBitStorage: a KeyValueStore header then the pairs.
+
+static uint8_t * StorePage(){
+    return SimFlashPage(NRF_FICR->CODESIZE - MICROBIT_STORAGE_STORE_PAGE_OFFSET);
+}
+
+static int StoreCapacity(){
+    return (NRF_FICR->CODEPAGESIZE - sizeof(KeyValueStore)) / MICROBIT_STORAGE_BLOCK_SIZE;
+}
+
+static KeyValuePair * StorePair(uint8_t * page, int index){
+    return (KeyValuePair *)(page + sizeof(KeyValueStore) + index * MICROBIT_STORAGE_BLOCK_SIZE);
+}
+
+static int StoreFind(uint8_t * page, const char * key){
+    KeyValueStore * store = (KeyValueStore *)page;
+    if (store->magic != MICROBIT_STORAGE_MAGIC)
+        return -1;
+
+    for (uint32_t i = 0; i < store->size; i++){
+        if (strcmp((const char *)StorePair(page, i)->key, key) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// Every change rewrites the whole page, the same as the real storage.
+static void StoreWrite(const uint8_t * page){
+    uint32_t size = NRF_FICR->CODEPAGESIZE;
+
+    Spend(SIM_FLASH_ERASE_TIME + size / 4 * SIM_FLASH_WORD_TIME);
+    memcpy(StorePage(), page, size);
+}
+
+int MicroBitStorage::put(const char * key, uint8_t * data, int dataSize){
+    if (dataSize > MICROBIT_STORAGE_VALUE_SIZE || strlen(key) >= MICROBIT_STORAGE_KEY_SIZE)
+        return MICROBIT_INVALID_PARAMETER;
+
+    std::vector<uint8_t> page(StorePage(), StorePage() + NRF_FICR->CODEPAGESIZE);
+    KeyValueStore * store = (KeyValueStore *)&page[0];
+    if (store->magic != MICROBIT_STORAGE_MAGIC){
+        store->magic = MICROBIT_STORAGE_MAGIC;
+        store->size = 0;
+    }
+
+    int index = StoreFind(&page[0], key);
+    if (index < 0){
+        if ((int)store->size >= StoreCapacity())
+            return MICROBIT_NO_RESOURCES;
+        index = store->size++;
+    }
+
+    KeyValuePair * pair = StorePair(&page[0], index);
+    memset(pair, 0, sizeof(KeyValuePair));
+    memcpy(pair->key, key, strlen(key));
+    memcpy(pair->value, data, dataSize);
+
+    StoreWrite(&page[0]);
+    return MICROBIT_OK;
+}
+
+int MicroBitStorage::put(ManagedString key, uint8_t * data, int dataSize){
+    return put(key.toCharArray(), data, dataSize);
+}
+
+KeyValuePair * MicroBitStorage::get(const char * key){
+    int index = StoreFind(StorePage(), key);
+    if (index < 0)
+        return NULL;
+
+    KeyValuePair * pair = new KeyValuePair;
+    memcpy(pair, StorePair(StorePage(), index), sizeof(KeyValuePair));
+    return pair;
+}
+
+KeyValuePair * MicroBitStorage::get(ManagedString key){
+    return get(key.toCharArray());
+}
+
+int MicroBitStorage::remove(const char * key){
+    int index = StoreFind(StorePage(), key);
+    if (index < 0)
+        return MICROBIT_NO_DATA;
+
+    std::vector<uint8_t> page(StorePage(), StorePage() + NRF_FICR->CODEPAGESIZE);
+    KeyValueStore * store = (KeyValueStore *)&page[0];
+
+    for (uint32_t i = index; i + 1 < store->size; i++){
+        memcpy(StorePair(&page[0], i), StorePair(&page[0], i + 1), sizeof(KeyValuePair));
+    }
+    store->size--;
+
+    StoreWrite(&page[0]);
+    return MICROBIT_OK;
+}
+
+int MicroBitStorage::remove(ManagedString key){
+    return remove(key.toCharArray());
+}
+
+int MicroBitStorage::size(){
+    KeyValueStore * store = (KeyValueStore *)StorePage();
+    return store->magic == MICROBIT_STORAGE_MAGIC ? store->size : 0;
+}
+
+// Harness controls
+
+void SimSetFlashBudget(int64_t bytes){
+    FlashBudget = bytes;
+}
+
+int64_t SimFlashBudget(){
+    return FlashBudget;
+}
+
+uint64_t SimFlashBytesChanged(){
+    return FlashBytesChanged;
+}
+
+uint64_t SimTime(){
+    return Now;
+}
+
+uint64_t SimIdleTime(){
+    return Idle;
+}
+
+uint64_t SimSpinTime(){
+    return Spin;
+}
+
+void SimSetSpinSkip(bool skip){
+    SpinSkip = skip;
+}
+
+void SimMarkExternal(){
+    Current->External = true;
+}
+
+void SimSleepUntil(uint64_t time){
+    Sleep(time, true);
+}
+
+bool SimTakeOutputChange(uint64_t * time, uint8_t * outputs){
+    if (OutputChanges.empty())
+        return false;
+
+    *time = OutputChanges.front().first;
+    *outputs = OutputChanges.front().second;
+    OutputChanges.pop_front();
+    return true;
+}
+
+bool SimTakeDisplayChange(uint64_t * time, ManagedString * shown){
+    if (DisplayChanges.empty())
+        return false;
+
+    *time = DisplayChanges.front().first;
+    *shown = DisplayChanges.front().second;
+    DisplayChanges.pop_front();
+    return true;
+}
+
+void SimWatchOutputs(bool watch){
+    WatchOutputs = watch;
+    OutputChanges.clear();
+    DisplayChanges.clear();
+}
+
+void SimSetButtons(uint8_t pressed){
+    Pressed = pressed;
+    UpdateInterrupt();
+}
+
+void SimSetButtonB(bool pressed){
+    ButtonBPressed = pressed;
+}
+
+void SimSetLoopbackWire(bool fitted){
+    LoopbackWire = fitted;
+    UpdateInterrupt();
+}
+
+const std::string & SimSerialOutput(){
+    return SerialOutput;
+}
+
+void SimClearSerial(){
+    SerialOutput.clear();
+}
+
+void SimSendSerial(const char * text){
+    while (*text){
+        SerialInput.push_back(*text++);
+    }
+}
@@ -0,0 +1,83 @@
+#include "TraceFile.h"
+#include <stdio.h>
+#include <string>
+
+// Reads a whole file, false if it can't be opened.
+static bool ReadFile(const char * path, std::string * text)
+{
+    FILE * file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return false;
+    }
+
+    char buffer[4096];
+    size_t count;
+    while ((count = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    {
+        text->append(buffer, count);
+    }
+
+    fclose(file);
+    return true;
+}
+
+// Moves on to the start of the next line. Send ends its lines with "\n\r".
+static size_t NextLine(const std::string & text, size_t position)
+{
+    position = text.find('\n', position);
+    if (position == std::string::npos)
+    {
+        return text.length();
+    }
+
+    while (position < text.length() && (text[position] == '\n' || text[position] == '\r'))
+    {
+        position++;
+    }
+    return position;
+}
+
+bool LoadTrace(const char * path, InputTrace * trace)
+{
+    std::string text;
+    if (!ReadFile(path, &text))
+    {
+        return false;
+    }
+
+    size_t position = text.find("TRACE:");
+    if (position == std::string::npos)
+    {
+        return false;
+    }
+
+    // Send writes everything as a signed int, so the seed and a missing response come back negative.
+    int mode, option, length;
+    long long seed;
+    if (sscanf(text.c_str() + position, "TRACE:%d,%d,%lld,%d", &mode, &option, &seed, &length) != 4 || length < 0 ||
+        length > TRACE_LENGTH)
+    {
+        return false;
+    }
+
+    trace->Begin(mode, (uint32_t)seed);
+    trace->SetOption(option);
+
+    for (int i = 0; i < length; i++)
+    {
+        position = NextLine(text, position);
+
+        int led, input, window;
+        long long delay;
+        if (position >= text.length() ||
+            sscanf(text.c_str() + position, "%d,%d,%lld,%d", &led, &input, &delay, &window) != 4)
+        {
+            return false;
+        }
+
+        trace->Add((uint8_t)led, (uint8_t)input, (uint32_t)delay, (uint8_t)window);
+    }
+
+    return true;
+}
@@ -0,0 +1,10 @@
+#ifndef __TRACEFILE__
+#define __TRACEFILE__
+#include "InputTrace.h"
+
+// Loads a trace saved from the device's serial output, as sent by InputTrace::Send (the t command). Anything
+// before the TRACE: header, e.g. the rest of the session, is ignored. Returns false if the file can't be read or
+// the trace in it is cut short or doesn't fit. Pairings aren't part of the dump, so the trace keeps its own.
+bool LoadTrace(const char * path, InputTrace * trace);
+
+#endif
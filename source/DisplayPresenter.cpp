@@ -0,0 +1,145 @@
+#include "DisplayPresenter.h"
+
+const char FrameGlyphs[] = PRESENTER_GLYPHS;
+
+
+DisplayPresenter::DisplayPresenter() : mpuBit(NULL), Head(0), Count(0), Playing(false), PlayingSkippable(false), SkipRequested(false) {
+}
+
+void DisplayPresenter::Init(MicroBit * uBit){
+    mpuBit = uBit;
+
+    // Render each glyph once so showing it later is just a copy of the image.
+    for (int i = 0; i < PRESENTER_FRAME_COUNT; i++){
+        Frames[i] = MicroBitImage(5, 5);
+        Frames[i].print(FrameGlyphs[i]);
+    }
+
+    create_fiber(RunFiber, this);
+}
+
+bool DisplayPresenter::ShowGlyph(char glyph, int duration, bool skippable){
+    int frame = FindFrame(glyph);
+    if (frame < 0)
+        return ShowText(ManagedString(glyph), skippable);
+
+    return Push(PresentGlyph, frame, ManagedString(), duration, skippable);
+}
+
+bool DisplayPresenter::ShowNumber(int number, int duration, bool skippable){
+    if (number >= 0 && number <= 9)
+        return ShowGlyph('0' + number, duration, skippable);
+
+    return ShowText(ManagedString(number), skippable);
+}
+
+bool DisplayPresenter::ShowText(ManagedString text, bool skippable){
+    // Each character is 5 columns plus a space, and the last one has to scroll off the edge.
+    int duration = (text.length() * 6 + 5) * PRESENTER_SCROLL_SPEED;
+    return Push(PresentText, 0, text, duration, skippable);
+}
+
+bool DisplayPresenter::ShowClear(int duration, bool skippable){
+    return Push(PresentClear, 0, ManagedString(), duration, skippable);
+}
+
+void DisplayPresenter::Skip(){
+    // Keep anything that can't be skipped, in order.
+    int kept = 0;
+    for (int i = 0; i < Count; i++){
+        PresenterItem & item = Queue[(Head + i) % PRESENTER_QUEUE_SIZE];
+        if (!item.Skippable){
+            Queue[(Head + kept) % PRESENTER_QUEUE_SIZE] = item;
+            kept++;
+        }
+    }
+    Count = kept;
+
+    if (Playing && PlayingSkippable)
+        SkipRequested = true;
+}
+
+bool DisplayPresenter::IsBusy(){
+    return Playing || Count > 0;
+}
+
+void DisplayPresenter::WaitUntilIdle(InputScheduler * input){
+    while (IsBusy()){
+        if (input->Poll() && input->GetPresses())
+            Skip();
+
+        fiber_sleep(PRESENTER_TICK);
+    }
+}
+
+bool DisplayPresenter::Push(PresenterItemType type, int frame, ManagedString text, int duration, bool skippable){
+    if (Count >= PRESENTER_QUEUE_SIZE)
+        return false;
+
+    PresenterItem & item = Queue[(Head + Count) % PRESENTER_QUEUE_SIZE];
+    item.Type = type;
+    item.Frame = frame;
+    item.Text = text;
+    item.Duration = duration;
+    item.Skippable = skippable;
+    Count++;
+
+    return true;
+}
+
+int DisplayPresenter::FindFrame(char glyph){
+    for (int i = 0; i < PRESENTER_FRAME_COUNT; i++){
+        if (FrameGlyphs[i] == glyph)
+            return i;
+    }
+    return -1;
+}
+
+void DisplayPresenter::Run(){
+    while (1){
+        if (Count == 0){
+            fiber_sleep(PRESENTER_TICK);
+            continue;
+        }
+
+        // Take the next item off the queue.
+        PresenterItem item = Queue[Head];
+        Head = (Head + 1) % PRESENTER_QUEUE_SIZE;
+        Count--;
+
+        Playing = true;
+        PlayingSkippable = item.Skippable;
+        SkipRequested = false;
+
+        mpuBit->display.stopAnimation();
+        switch (item.Type){
+            case PresentGlyph:
+                mpuBit->display.print(Frames[item.Frame]);
+                break;
+            case PresentText:
+                mpuBit->display.scrollAsync(item.Text, PRESENTER_SCROLL_SPEED);
+                break;
+            case PresentClear:
+                mpuBit->display.clear();
+                break;
+        }
+
+        // Wait for the item to finish, or for it to be skipped.
+        int elapsed = 0;
+        while (elapsed < item.Duration && !SkipRequested){
+            fiber_sleep(PRESENTER_TICK);
+            elapsed += PRESENTER_TICK;
+        }
+
+        if (SkipRequested){
+            mpuBit->display.stopAnimation();
+            mpuBit->display.clear();
+        }
+
+        Playing = false;
+    }
+}
+
+void DisplayPresenter::RunFiber(void * presenter){
+    ((DisplayPresenter *)presenter)->Run();
+}
@@ -0,0 +1,89 @@
+#ifndef __DISPLAYPRESENTER__
+#define __DISPLAYPRESENTER__
+#include "MicroBit.h"
+#include "InputScheduler.h"
+
+// Maximum number of items that can be waiting to be shown.
+#define PRESENTER_QUEUE_SIZE 24
+
+// Speed used when scrolling text (ms per column).
+#define PRESENTER_SCROLL_SPEED 120
+
+// How often the presenter checks whether the current item has finished (ms).
+#define PRESENTER_TICK 10
+
+// Characters that have a pre-rendered frame, in the order the frames are kept.
+#define PRESENTER_GLYPHS "0123456789<>!?"
+#define PRESENTER_FRAME_COUNT (int)(sizeof(PRESENTER_GLYPHS) - 1)
+
+enum PresenterItemType{
+    PresentGlyph,
+    PresentText,
+    PresentClear
+};
+
+struct PresenterItem{
+    PresenterItemType Type;
+    // Index into the pre-rendered frames for glyphs.
+    int Frame;
+    ManagedString Text;
+    // How long the item stays on the display (ms). Zero leaves it there until the next item.
+    int Duration;
+    // Whether a button press can cut this item short.
+    bool Skippable;
+};
+
+class DisplayPresenter{
+    public:
+    DisplayPresenter();
+
+    // Renders the frames and starts the fiber that plays the queue.
+    void Init(MicroBit * uBit);
+
+    // Queues one of the pre-rendered glyphs (0-9, <, >, !, ?).
+    bool ShowGlyph(char glyph, int duration, bool skippable = true);
+
+    // Queues a number, single digits use the pre-rendered frames and anything larger is scrolled.
+    bool ShowNumber(int number, int duration, bool skippable = true);
+
+    // Queues text to be scrolled across the display.
+    bool ShowText(ManagedString text, bool skippable = true);
+
+    // Queues a blank display.
+    bool ShowClear(int duration, bool skippable = true);
+
+    // Drops every skippable item, including the one currently being shown.
+    void Skip();
+
+    // Returns true while anything is being shown or is waiting to be shown.
+    bool IsBusy();
+
+    // Blocks until the queue is empty, sampling through input. A new press skips whatever can be skipped, a button
+    // already held when it starts doesn't.
+    void WaitUntilIdle(InputScheduler * input);
+
+    private:
+    MicroBit * mpuBit;
+
+    MicroBitImage Frames[PRESENTER_FRAME_COUNT];
+
+    PresenterItem Queue[PRESENTER_QUEUE_SIZE];
+    int Head;
+    int Count;
+
+    bool Playing;
+    bool PlayingSkippable;
+    bool SkipRequested;
+
+    bool Push(PresenterItemType type, int frame, ManagedString text, int duration, bool skippable);
+
+    // Finds the pre-rendered frame for the glyph. Returns -1 if there isn't one.
+    int FindFrame(char glyph);
+
+    // Plays the queue forever.
+    void Run();
+    static void RunFiber(void * presenter);
+
+};
+
+#endif
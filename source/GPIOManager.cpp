@@ -2,7 +2,12 @@
 #include "GPIOManager.h"
 
 
-GPIOManager::GPIOManager(){
+GPIOManager::GPIOManager() : OutputMask(0), LastPortB(0), InputTime(0), TraceMode(TraceOff), mpTrace(NULL), StimulusCursor(0), StimulusUsed(0), Status(ReplayOK), ReplayActivityTime(0), Window(-1), WindowTime(0), EarlyCursor(0), LoopbackLED(-1), LoopbackInput(0), LoopbackDelay(0), LoopbackChangeTime(0) {
+    for (int i = 0; i < 8; i++){
+        StimulusTime[i] = 0;
+        ActiveEvent[i] = -1;
+    }
+    ResetStats();
 }
 
 void GPIOManager::Init(MicroBit * uBit){
@@ -49,7 +54,8 @@ void GPIOManager::digitalWrite(int pin, bool val){
         // Write the mask to the output
         CommsBuffer.Data[0] = 0x09;
         CommsBuffer.Data[1] = currentMask;
-        mpuBit->i2c.write(0x40, CommsBuffer.Data, 2);
+        BusWrite(CommsBuffer.Data, 2);
+        UpdateOutputs(currentMask);
         
         // CommsBuffer.Data[0] = 0x19;
         // CommsBuffer.Data[1] = Mask.Data[1];
@@ -65,12 +71,21 @@ bool GPIOManager::digitalRead(int pin){
 
 void GPIOManager::SendCommand(uint16_t Command){
     CommsBuffer.Value = Command;
-    mpuBit->i2c.write(0x40, CommsBuffer.Data, 2);
+    BusWrite(CommsBuffer.Data, 2);
 }
 
 char GPIOManager::ReadPortB(){
 
-return readRegister(0x19);
+    char port = readRegister(0x19);
+
+    // The bus is still read during a replay so that the timing matches a real game.
+    if (TraceMode == TraceReplay)
+        port = ReplayInputs();
+    else if (LoopbackLED >= 0)
+        port = LoopbackInputs(port);
+
+    LastPortB = port;
+    return port;
     // char port = 0x19;
     
     // // Select port B
@@ -88,11 +103,11 @@ char GPIOManager::readRegister(char addr){
 
       
     // Select address
-    mpuBit->i2c.write(0x40, &addr, 1);
+    BusWrite(&addr, 1);
     
     char ReadByte = 0;
     // Read the byte
-    mpuBit->i2c.read(0x40, &ReadByte, 1);
+    BusRead(&ReadByte, 1);
 
     return ReadByte;
 
@@ -101,8 +116,10 @@ char GPIOManager::readRegister(char addr){
 void GPIOManager::writeRegister(char addr, char value){
     CommsBuffer.Data[0] = addr;
     CommsBuffer.Data[1] = value;
-    mpuBit->i2c.write(0x40, CommsBuffer.Data, 2);
+    BusWrite(CommsBuffer.Data, 2);
 
+    if (addr == 0x09)
+        UpdateOutputs(value);
 }
 
 bool GPIOManager::isBitSet(char data, int bit){
@@ -120,4 +137,348 @@ bool GPIOManager::isBitSetExclusive(char data, int bit){
     data &= temp;
     return data == temp;
 
-}
\ No newline at end of file
+}
+
+bool GPIOManager::InputPending(){
+    // Like the expander, only signal a change since port B was last read.
+    if (TraceMode == TraceReplay)
+        return ReplayInputs() != LastPortB;
+
+    return mpuBit->io.P8.getDigitalValue();
+}
+
+// Keeps the earliest of the times after since.
+static void TakeEarliest(uint32_t * next, uint32_t since, uint32_t time){
+    if ((int32_t)(time - since) > 0 && (int32_t)(time - *next) < 0)
+        *next = time;
+}
+
+uint32_t GPIOManager::GetNextChange(){
+    uint32_t next = us_ticker_read() + GPIO_NO_CHANGE;
+
+    // Anything from after the inputs were last read, the caller may have checked them just before it happened.
+    uint32_t since = InputTime;
+
+    if (TraceMode == TraceReplay){
+        // Each replayed press goes down after its delay and comes back up once it has been held.
+        for (int i = 0; i < 8; i++){
+            if (ActiveEvent[i] < 0)
+                continue;
+
+            TraceEvent * event = mpTrace->GetEvent(ActiveEvent[i]);
+            if (event->Delay == TRACE_NO_RESPONSE)
+                continue;
+
+            TakeEarliest(&next, since, StimulusTime[i] + event->Delay);
+            TakeEarliest(&next, since, StimulusTime[i] + event->Delay + TRACE_HOLD_TIME);
+        }
+
+        if (Window >= 0){
+            for (int i = EarlyCursor; i < mpTrace->GetLength(); i++){
+                TraceEvent * event = mpTrace->GetEvent(i);
+                if (event->LEDPin != TRACE_EARLY_PIN)
+                    continue;
+                if (event->Window != Window)
+                    break;
+
+                TakeEarliest(&next, since, WindowTime + event->Delay);
+                TakeEarliest(&next, since, WindowTime + event->Delay + TRACE_HOLD_TIME);
+            }
+        }
+
+        if (Status == ReplayOK)
+            TakeEarliest(&next, since, ReplayActivityTime + TRACE_STALL_TIME + 1);
+    }
+
+    if (LoopbackLED >= 0)
+        TakeEarliest(&next, since, LoopbackChangeTime + LoopbackDelay);
+
+    return next;
+}
+
+void GPIOManager::StartRecording(InputTrace * trace){
+    mpTrace = trace;
+    TraceMode = TraceRecord;
+    Window = -1;
+
+    for (int i = 0; i < 8; i++){
+        StimulusTime[i] = 0;
+        ActiveEvent[i] = -1;
+    }
+}
+
+void GPIOManager::StartReplay(InputTrace * trace){
+    mpTrace = trace;
+    TraceMode = TraceReplay;
+    StimulusCursor = 0;
+    StimulusUsed = 0;
+    Status = ReplayOK;
+    ReplayActivityTime = us_ticker_read();
+    Window = -1;
+    EarlyCursor = 0;
+
+    for (int i = 0; i < 8; i++){
+        StimulusTime[i] = 0;
+        ActiveEvent[i] = -1;
+    }
+
+    // Anything already lit counts as a stimulus from now.
+    char mask = OutputMask;
+    OutputMask = 0;
+    UpdateOutputs(mask);
+}
+
+void GPIOManager::StopTrace(){
+    TraceMode = TraceOff;
+    mpTrace = NULL;
+}
+
+void GPIOManager::MarkResponse(int ledPin, int inputPin, uint32_t time){
+    if (TraceMode == TraceOff || ActiveEvent[ledPin] < 0)
+        return;
+
+    if (TraceMode == TraceRecord){
+        // Fill in the stimulus added when the LED lit.
+        TraceEvent * event = mpTrace->GetEvent(ActiveEvent[ledPin]);
+        event->InputPin = inputPin;
+        event->Delay = time;
+    }else if (TraceMode == TraceReplay){
+        // Compare what the game measured against what the trace played.
+        uint32_t expected = mpTrace->GetEvent(ActiveEvent[ledPin])->Delay;
+        uint32_t error = time > expected ? time - expected : expected - time;
+
+        ReplayStats & stats = Replay[ledPin];
+        stats.Responses++;
+        stats.TotalError += error;
+        if (error > stats.MaxError)
+            stats.MaxError = error;
+    }
+}
+
+void GPIOManager::MarkWindow(){
+    if (TraceMode == TraceOff)
+        return;
+
+    Window++;
+    WindowTime = us_ticker_read();
+
+    // Early presses are kept in the order they were made, so this window's start after the last one's.
+    if (TraceMode == TraceReplay){
+        int length = mpTrace->GetLength();
+        while (EarlyCursor < length){
+            TraceEvent * event = mpTrace->GetEvent(EarlyCursor);
+            if (event->LEDPin == TRACE_EARLY_PIN && event->Window >= Window)
+                break;
+            EarlyCursor++;
+        }
+    }
+}
+
+void GPIOManager::MarkEarlyPress(int inputPin, uint32_t time){
+    if (TraceMode != TraceRecord || Window < 0)
+        return;
+
+    mpTrace->Add(TRACE_EARLY_PIN, inputPin, time - WindowTime, Window);
+}
+
+ReplayStatus GPIOManager::GetReplayStatus(){
+    return Status;
+}
+
+bool GPIOManager::IsReplayStalled(){
+    if (TraceMode != TraceReplay)
+        return false;
+
+    if (Status == ReplayOK && us_ticker_read() - ReplayActivityTime > TRACE_STALL_TIME)
+        Status = ReplayStalled;
+
+    return Status != ReplayOK;
+}
+
+void GPIOManager::StartLoopback(int ledPin, int inputPin, uint32_t delay){
+    LoopbackLED = ledPin;
+    LoopbackInput = inputPin;
+    LoopbackDelay = delay;
+    LoopbackChangeTime = us_ticker_read();
+}
+
+void GPIOManager::StopLoopback(){
+    LoopbackLED = -1;
+}
+
+void GPIOManager::ResetStats(){
+    Bus.Reads = 0;
+    Bus.Writes = 0;
+    Bus.Errors = 0;
+    Bus.BusyTime = 0;
+
+    for (int i = 0; i < 8; i++){
+        Replay[i].Responses = 0;
+        Replay[i].TotalError = 0;
+        Replay[i].MaxError = 0;
+    }
+}
+
+BusStats GPIOManager::GetBusStats(){
+    return Bus;
+}
+
+ReplayStats GPIOManager::GetReplayStats(){
+    ReplayStats total = {0, 0, 0};
+
+    for (int i = 0; i < 8; i++){
+        total.Responses += Replay[i].Responses;
+        total.TotalError += Replay[i].TotalError;
+        if (Replay[i].MaxError > total.MaxError)
+            total.MaxError = Replay[i].MaxError;
+    }
+
+    return total;
+}
+
+ReplayStats GPIOManager::GetReplayStats(int ledPin){
+    return Replay[ledPin];
+}
+
+int GPIOManager::BusWrite(char * data, int length){
+    uint32_t start = us_ticker_read();
+    int result = mpuBit->i2c.write(0x40, data, length);
+    Bus.BusyTime += us_ticker_read() - start;
+
+    Bus.Writes++;
+    if (result != MICROBIT_OK)
+        Bus.Errors++;
+
+    return result;
+}
+
+int GPIOManager::BusRead(char * data, int length){
+    uint32_t start = us_ticker_read();
+    int result = mpuBit->i2c.read(0x40, data, length);
+    Bus.BusyTime += us_ticker_read() - start;
+
+    Bus.Reads++;
+    if (result != MICROBIT_OK)
+        Bus.Errors++;
+
+    return result;
+}
+
+void GPIOManager::UpdateOutputs(char mask){
+    if (LoopbackLED >= 0 && isBitSet(mask ^ OutputMask, LoopbackLED))
+        LoopbackChangeTime = us_ticker_read();
+
+    if (TraceMode != TraceOff){
+        uint32_t now = us_ticker_read();
+
+        for (int i = 0; i < 8; i++){
+            bool wasOn = isBitSet(OutputMask, i);
+            bool isOn = isBitSet(mask, i);
+
+            if (isOn && !wasOn){
+                StimulusTime[i] = now;
+
+                if (TraceMode == TraceRecord)
+                    ActiveEvent[i] = mpTrace->Add(i, TRACE_ANY_PIN, TRACE_NO_RESPONSE);
+                else
+                    ActiveEvent[i] = NextStimulus(i);
+            }else if (!isOn && wasOn){
+                ActiveEvent[i] = -1;
+            }
+        }
+    }
+
+    OutputMask = mask;
+}
+
+int GPIOManager::NextStimulus(int ledPin){
+    // Once the replay has gone wrong nothing else is pressed.
+    if (Status != ReplayOK)
+        return -1;
+
+    // Move past stimuli already taken out of order, and early presses, which are played from their window rather
+    // than by an LED lighting.
+    int length = mpTrace->GetLength();
+    while (StimulusCursor < length && ((StimulusUsed & ((uint64_t)1 << StimulusCursor)) ||
+                                       mpTrace->GetEvent(StimulusCursor)->LEDPin == TRACE_EARLY_PIN))
+        StimulusCursor++;
+
+    if (StimulusCursor >= length){
+        Status = ReplayEnded;
+        return -1;
+    }
+
+    // Stimuli are played back in the order they were lit, so each one gets the response it had when recorded. One
+    // lit a little out of order is taken from just ahead of the cursor.
+    for (int i = StimulusCursor; i < length && i < StimulusCursor + TRACE_REORDER_WINDOW; i++){
+        TraceEvent * event = mpTrace->GetEvent(i);
+        if ((StimulusUsed & ((uint64_t)1 << i)) || event->LEDPin == TRACE_EARLY_PIN)
+            continue;
+        if (event->LEDPin != TRACE_ANY_PIN && event->LEDPin != ledPin)
+            continue;
+
+        StimulusUsed |= (uint64_t)1 << i;
+
+        ReplayActivityTime = us_ticker_read();
+        return i;
+    }
+
+    Status = ReplayDiverged;
+    return -1;
+}
+
+char GPIOManager::ReplayInputs(){
+    uint32_t now = us_ticker_read();
+    char value = 0;
+
+    InputTime = now;
+
+    for (int i = 0; i < 8; i++){
+        if (ActiveEvent[i] < 0)
+            continue;
+
+        TraceEvent * event = mpTrace->GetEvent(ActiveEvent[i]);
+        uint32_t elapsed = now - StimulusTime[i];
+
+        // The button is held for a short time, then released. A stimulus with no response is never pressed.
+        if (elapsed >= event->Delay && elapsed - event->Delay < TRACE_HOLD_TIME){
+            uint8_t input = event->InputPin == TRACE_ANY_PIN ? mpTrace->GetPairing(i) : event->InputPin;
+            value |= 1 << input;
+        }
+    }
+
+    // Presses made in the current window before anything was lit.
+    if (Window >= 0){
+        uint32_t elapsed = now - WindowTime;
+        for (int i = EarlyCursor; i < mpTrace->GetLength(); i++){
+            TraceEvent * event = mpTrace->GetEvent(i);
+            if (event->LEDPin != TRACE_EARLY_PIN)
+                continue;
+            if (event->Window != Window)
+                break;
+
+            if (elapsed >= event->Delay && elapsed - event->Delay < TRACE_HOLD_TIME)
+                value |= 1 << event->InputPin;
+        }
+    }
+
+    if (value)
+        ReplayActivityTime = now;
+
+    return value;
+}
+
+char GPIOManager::LoopbackInputs(char port){
+    bool led = isBitSet(OutputMask, LoopbackLED);
+
+    // The input follows the LED once the delay has passed.
+    InputTime = us_ticker_read();
+    if (InputTime - LoopbackChangeTime < LoopbackDelay)
+        led = !led;
+
+    // Port B polarity is inverted, so a lit LED reads back as 0 just like the real wire.
+    if (led)
+        return port & ~(1 << LoopbackInput);
+
+    return port | (1 << LoopbackInput);
+}
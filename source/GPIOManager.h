@@ -1,6 +1,7 @@
 #ifndef __GPIOMANAGER__
 #define __GPIOMANAGER__
 #include "MicroBit.h"
+#include "InputTrace.h"
 
 
 
@@ -9,6 +10,45 @@ union BuffStruct{
     char Data[2];
 };
 
+// Counters describing the i2c traffic generated by the manager.
+struct BusStats{
+    uint32_t Reads;
+    uint32_t Writes;
+    uint32_t Errors;
+    // Total time spent blocked on the bus (us)
+    uint32_t BusyTime;
+};
+
+// How far ahead of now GetNextChange answers when nothing is due (us).
+#define GPIO_NO_CHANGE 1000000
+
+// Replayed reaction times should be measured to within this (us).
+#define REPLAY_ERROR_BUDGET 2000
+
+// How far the measured response times were from the ones in the trace being replayed.
+struct ReplayStats{
+    uint32_t Responses;
+    uint32_t TotalError;
+    uint32_t MaxError;
+};
+
+enum TraceModes{
+    TraceOff,
+    TraceRecord,
+    TraceReplay
+};
+
+// Whether the trace being replayed still matches the game.
+enum ReplayStatus{
+    ReplayOK,
+    // An LED lit after the last stimulus in the trace.
+    ReplayEnded,
+    // An LED lit that isn't the next one in the trace.
+    ReplayDiverged,
+    // Nothing was pressed for TRACE_STALL_TIME.
+    ReplayStalled
+};
+
 class GPIOManager{
     public:
     GPIOManager();
@@ -30,12 +70,114 @@ class GPIOManager{
 
     bool isBitSetExclusive(char data, int bit);
 
+    // Returns true when the expander is signalling a change on port B (via P8).
+    // During a replay this is true when the trace no longer matches the last value read.
+    bool InputPending();
+
+    // When port B, or the state of the replay, next changes on its own rather than through a button, e.g. a
+    // replayed press or the modelled loopback catching up. A change since the inputs were last read is still
+    // returned even though it's already past. Well ahead of now if nothing like that is due.
+    uint32_t GetNextChange();
+
+    // Records every stimulus into the trace, along with the response reported through MarkResponse.
+    void StartRecording(InputTrace * trace);
+
+    // Serves port B from the trace instead of the buttons.
+    void StartReplay(InputTrace * trace);
+
+    void StopTrace();
+
+    // Called by the games when a response to the stimulus on ledPin has been detected.
+    void MarkResponse(int ledPin, int inputPin, uint32_t time);
+
+    // Called by the games when a window where early presses count opens (e.g. a countdown). Early presses are
+    // timed from here.
+    void MarkWindow();
+
+    // Called by the games when a press before its stimulus (a jump or false start) has been detected.
+    void MarkEarlyPress(int inputPin, uint32_t time);
+
+    ReplayStatus GetReplayStatus();
+
+    // Returns true once the replay can't press anything else, so the game should give up waiting.
+    bool IsReplayStalled();
+
+    // Models a wire from ledPin to inputPin, port B reads see the output after the given delay (us).
+    // The bus is still used as normal so the timing can be compared against a real loopback.
+    void StartLoopback(int ledPin, int inputPin, uint32_t delay);
+
+    void StopLoopback();
+
+    void ResetStats();
+
+    BusStats GetBusStats();
+
+    // Totals for every output.
+    ReplayStats GetReplayStats();
+
+    // Just the responses to the given output.
+    ReplayStats GetReplayStats(int ledPin);
+
     private:
     BuffStruct CommsBuffer;
     MicroBit * mpuBit;
 
+    // Last value written to the port A outputs.
+    char OutputMask;
+
+    // Last value ReadPortB returned.
+    char LastPortB;
+    // When the replayed or looped back inputs were last worked out. Changes after this haven't been seen yet,
+    // even once they're in the past.
+    uint32_t InputTime;
+
+    TraceModes TraceMode;
+    InputTrace * mpTrace;
+
+    // When each output was last turned on, and which trace event it is waiting on.
+    uint32_t StimulusTime[8];
+    int ActiveEvent[8];
+
+    // The first stimulus in the trace not yet replayed, and a bit for each one that has been.
+    int StimulusCursor;
+    uint64_t StimulusUsed;
+    ReplayStatus Status;
+    // Last time the replay lit a stimulus or pressed a button.
+    uint32_t ReplayActivityTime;
+
+    // The window early presses are being timed in (-1 before the first), when it opened, and where its early
+    // presses start in the trace being replayed.
+    int Window;
+    uint32_t WindowTime;
+    int EarlyCursor;
+
+    // Modelled loopback, LoopbackLED is -1 when it is off.
+    int LoopbackLED;
+    int LoopbackInput;
+    uint32_t LoopbackDelay;
+    uint32_t LoopbackChangeTime;
+
+    BusStats Bus;
+    ReplayStats Replay[8];
+
     void SendCommand(uint16_t Command);
 
+    // All i2c traffic goes through these so that it can be counted.
+    int BusWrite(char * data, int length);
+    int BusRead(char * data, int length);
+
+    // Keeps track of which outputs have been lit for the trace being recorded or replayed.
+    void UpdateOutputs(char mask);
+
+    // Takes the next stimulus from the trace for an LED that has just lit. Returns -1 if the trace doesn't have one.
+    int NextStimulus(int ledPin);
+
+    // Works out what port B would read from the trace being replayed.
+    char ReplayInputs();
+
+    // Applies the modelled loopback to a port B value.
+    char LoopbackInputs(char port);
+
 
 
 };
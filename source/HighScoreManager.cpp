@@ -3,121 +3,207 @@
 #include "HighScoreManager.h"
 #include "MicroBit.h"
 
-const char NumEntryString[] = "NumEntries";
-const char BestTimeIDString[] = "BestTimeID";
-
-
-HighScoreManager::HighScoreManager() : NumberOfEntries(0), AverageTime(0), BestTimeID(0) {
+// Keys used before scores were kept in their own log. Removed when found.
+const char * LegacyKeys[] = {"NumEntries", "BestTimeID", "Initialised"};
 
+// Standard CRC32 (reflected, 0xEDB88320), done a bit at a time to save the table.
+static uint32_t Crc32(const uint8_t * data, int length){
+    uint32_t crc = 0xFFFFFFFF;
 
+    for (int i = 0; i < length; i++){
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++){
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+        }
+    }
 
+    return ~crc;
 }
 
-bool HighScoreManager::Initialise(MicroBit * uBit){
-    mpuBit = uBit;
 
+HighScoreManager::HighScoreManager() : NumberOfEntries(0), BestTimeID(0), BestTime(0), AverageTime(0), Sequence(0), Epoch(0), ActivePage(-1), Generation(0), NextSlot(0), LogFits(false), Staged(false), StagedTime(0), StagedMode(0) {
 
-    // Check if the uBit has previously stored the initialised header. If not, default values will need to be written to flash.
-    KeyValuePair* tempKVP = mpuBit->storage.get("Initialised");
-    if (tempKVP == NULL){
-        // Header has not been written, write defualt headers
-        Reset();
-    }else{
-        //Headers 'should' exist, check for each.
-        
-        KeyValuePair* NumEntryKvp = mpuBit->storage.get(NumEntryString);
-        KeyValuePair* BestTimeKvp = mpuBit->storage.get(BestTimeIDString);
 
-        // If either of these keys don't exist for some exotic reason then Reset the high scores.
-        if (NumEntryKvp == NULL || BestTimeKvp == NULL){
-            Reset();
 
+}
+
+bool HighScoreManager::Initialise(MicroBit * uBit){
+    mpuBit = uBit;
 
+    // The pages are counted back from the end of the code space, so a big enough program runs into them and the
+    // first score would erase part of it. Treat the log as empty and never write it.
+    LogFits = (uint32_t)(uintptr_t)GetLogPage(0) >= PROGRAM_IMAGE_END;
+
+    // The page in use is the complete one that was filled last.
+    ActivePage = -1;
+    for (int page = 0; LogFits && page < SCORE_LOG_PAGES; page++){
+        uint32_t pageGeneration;
+        if (ReadHeader(page, &pageGeneration) && (ActivePage < 0 || pageGeneration > Generation)){
+            ActivePage = page;
+            Generation = pageGeneration;
         }
+    }
 
-        // They must both be OK, read their values into variables.
-        memcpy(&NumberOfEntries, NumEntryKvp->value, sizeof(int));
-        memcpy(&BestTimeID, BestTimeKvp->value, sizeof(int));
+    // One pass over the page, the newest valid record holds the header.
+    // Anything torn by a power cut fails its CRC and is skipped, leaving the record before it.
+    // New records go after the last slot anything was written to, torn or not.
+    NextSlot = 1;
+    if (ActivePage >= 0){
+        bool found = false;
+        ScoreRecord latest;
+        memset(&latest, 0, sizeof(latest));
+
+        for (int slot = 1; slot < GetSlotCount(); slot++){
+            const uint8_t * data = GetSlot(ActivePage, slot);
+            if (!IsBlank(data, sizeof(ScoreRecord)))
+                NextSlot = slot + 1;
+
+            ScoreRecord record;
+            if (DecodeRecord(data, &record) && (!found || record.Sequence > latest.Sequence)){
+                latest = record;
+                found = true;
+            }
+        }
 
-        // Clean up the mess....
-        delete NumEntryKvp;
-        delete BestTimeKvp;
+        Sequence = latest.Sequence;
+        Epoch = latest.Epoch;
+        NumberOfEntries = latest.NumberOfEntries;
+        BestTimeID = latest.BestTimeID;
+        BestTime = latest.BestTime;
+    }
 
+    // Scores from the old format can't be trusted, so drop the old header keys to free up space.
+    for (unsigned int j = 0; j < sizeof(LegacyKeys) / sizeof(LegacyKeys[0]); j++){
+        mpuBit->storage.remove(LegacyKeys[j]);
     }
 
-    delete tempKVP;
-    // Write the Initialised key for next boot.
-    int init = 1;
-    mpuBit->storage.put("Initialised", (uint8_t *)&init, sizeof(init));
+    return LogFits;
+}
 
 
+bool HighScoreManager::Reset(){
+    // A record with no score that starts a new epoch, everything before it is ignored from now on.
+    ScoreRecord record;
+    memset(&record, 0, sizeof(record));
+    record.Epoch = Sequence + 1;
+
+    // Taken on before the write, so nothing from the old epoch is carried over if the log moves page.
+    uint32_t oldEpoch = Epoch;
+    uint16_t oldNumberOfEntries = NumberOfEntries;
+    uint16_t oldBestTimeID = BestTimeID;
+    uint32_t oldBestTime = BestTime;
+    Epoch = record.Epoch;
+    NumberOfEntries = 0;
+    BestTimeID = 0;
+    BestTime = 0;
+
+    if (!WriteRecord(&record)){
+        Epoch = oldEpoch;
+        NumberOfEntries = oldNumberOfEntries;
+        BestTimeID = oldBestTimeID;
+        BestTime = oldBestTime;
+        return false;
+    }
 
+    Staged = false;
 
     return true;
 }
 
+bool HighScoreManager::Stage(uint32_t Time, uint8_t Mode){
+    if (Staged)
+        return false;
 
-bool HighScoreManager::Reset(){
-        // Write the number of entries
-        mpuBit->storage.put(NumEntryString, (uint8_t *)&NumberOfEntries, sizeof(NumberOfEntries));
-
-        // Write the entry ID for the current highest score
-        mpuBit->storage.put(BestTimeIDString, (uint8_t *)&BestTimeID, sizeof(BestTimeID));
+    StagedTime = Time;
+    StagedMode = Mode;
+    Staged = true;
 
-        return true;
+    return true;
 }
 
-uint16_t HighScoreManager::AddEntry(uint32_t Time){
-    char tempStore[sizeof(uint16_t)] = {0};
+bool HighScoreManager::Commit(){
+    if (!Staged)
+        return true;
 
     // Form the ID of the next available entry ID.
     // Entry ID's are indexed based to zero therefore the nextEntryID is equal to the number of entries total.
     uint16_t nextEntryId = NumberOfEntries;
 
-    memcpy(tempStore, &nextEntryId, sizeof(uint16_t));
+    ScoreRecord record;
+    memset(&record, 0, sizeof(record));
+    record.Epoch = Epoch;
+    record.Time = StagedTime;
+    record.Id = nextEntryId;
+    record.Mode = StagedMode;
+    record.Flags = RECORD_HAS_ENTRY;
+    record.NumberOfEntries = NumberOfEntries + 1;
+
+    // If this is the first entry, or the current best time is greater than this, it is the new best.
+    if (nextEntryId == 0 || BestTime > StagedTime){
+        record.BestTimeID = nextEntryId;
+        record.BestTime = StagedTime;
+    }else{
+        record.BestTimeID = BestTimeID;
+        record.BestTime = BestTime;
+    }
+
+    // Only take on the changes once they are in flash.
+    if (!WriteRecord(&record))
+        return false;
 
-    mpuBit->storage.put(tempStore,(uint8_t *)&Time, sizeof(Time));
+    NumberOfEntries = record.NumberOfEntries;
+    BestTimeID = record.BestTimeID;
+    BestTime = record.BestTime;
+    Staged = false;
 
-    NumberOfEntries++;
-    mpuBit->storage.put(NumEntryString, (uint8_t *)&NumberOfEntries, sizeof(NumberOfEntries));
+    return true;
+}
 
-    // If this is the first entry, the best time is already correct.    
-    if (nextEntryId == 0)
-        return nextEntryId;
+uint16_t HighScoreManager::AddEntry(uint32_t Time, uint8_t Mode){
+    uint16_t nextEntryId = NumberOfEntries;
 
-    // Is this the new highest score??
-    uint32_t currentBest = 0;
-    GetScore(BestTimeID, &currentBest);
+    // Whatever is already staged belongs to someone else, leave it for them to commit.
+    if (!Stage(Time, Mode))
+        return SCORE_NO_ID;
 
-    // If the current best time is greater than this, it is worse.
-    if (currentBest > Time){
-        BestTimeID = nextEntryId;
-        mpuBit->storage.put(BestTimeIDString, (uint8_t *)&BestTimeID, sizeof(BestTimeID));
+    // Nobody is going to retry this one, so don't leave it staged if the write fails.
+    if (!Commit()){
+        Staged = false;
+        return SCORE_NO_ID;
     }
+
     return nextEntryId;
 
 }
 
+int HighScoreManager::GetNextEntryID(){
+    return NumberOfEntries;
+}
+
+int HighScoreManager::GetNumberOfEntries(){
+    return NumberOfEntries;
+}
+
+unsigned int HighScoreManager::GetBestTime(){
+    return BestTime;
+}
+
 bool HighScoreManager::GetScore(uint16_t Id, uint32_t * Time){
-    // Temp space for referring to a score's ID
-    char tempStore[sizeof(uint16_t)];
-    
-    // Attempt to move the Id into the temp store
-    memcpy(tempStore, &Id, sizeof(uint16_t));
-
-    // Read this key from storage
-    KeyValuePair* Score = mpuBit->storage.get(tempStore);
-
-    if (Score == NULL){
-        delete Score;
-        *Time = 0;
+    *Time = 0;
+    if (ActivePage < 0)
         return false;
+
+    // Scores are only ever in the page in use, anything from before a Reset or torn is skipped.
+    for (int slot = 1; slot < NextSlot; slot++){
+        ScoreRecord record;
+        if (DecodeRecord(GetSlot(ActivePage, slot), &record) && IsCurrentEntry(&record) && record.Id == Id){
+            *Time = record.Time;
+            // Success
+            return true;
+        }
     }
-    // Valid key, copy the value from memory
-    memcpy(Time, Score->value, sizeof(uint32_t));
 
-    // Success
-    return true;
+    return false;
 
 }
 
@@ -138,5 +224,173 @@ void HighScoreManager::CalculateAverage(){
 
     AverageTime = sum / (double) NumberOfEntries;
 
-    
-}
\ No newline at end of file
+
+}
+
+int HighScoreManager::ReadEntries(ScoreEntry * Buffer, int MaxEntries, int * Cursor, const ScoreFilter * Filter){
+    int count = 0;
+
+    if (ActivePage < 0)
+        return 0;
+
+    // The cursor counts record slots, the page header is skipped.
+    while (*Cursor + 1 < NextSlot && count < MaxEntries){
+        const uint8_t * data = GetSlot(ActivePage, *Cursor + 1);
+        (*Cursor)++;
+
+        // Skip the reset and header records, and anything stale or damaged.
+        ScoreRecord record;
+        if (!DecodeRecord(data, &record) || !IsCurrentEntry(&record))
+            continue;
+
+        ScoreEntry entry;
+        entry.Id = record.Id;
+        entry.Time = record.Time;
+        entry.Mode = record.Mode;
+
+        if (Filter != NULL){
+            if (Filter->Mode != 0 && Filter->Mode != entry.Mode)
+                continue;
+            if (entry.Id < Filter->FirstId || entry.Id > Filter->LastId)
+                continue;
+        }
+
+        Buffer[count] = entry;
+        count++;
+    }
+
+    return count;
+}
+
+uint8_t * HighScoreManager::GetLogPage(int Page){
+    uint32_t pageSize = NRF_FICR->CODEPAGESIZE;
+    uint32_t pageNumber = NRF_FICR->CODESIZE - SCORE_LOG_PAGE_OFFSET + Page;
+
+    return (uint8_t *)(uintptr_t)(pageSize * pageNumber);
+}
+
+uint8_t * HighScoreManager::GetSlot(int Page, int Slot){
+    return GetLogPage(Page) + Slot * sizeof(ScoreRecord);
+}
+
+int HighScoreManager::GetSlotCount(){
+    return NRF_FICR->CODEPAGESIZE / sizeof(ScoreRecord);
+}
+
+bool HighScoreManager::IsBlank(const uint8_t * Data, int Length){
+    for (int i = 0; i < Length; i++){
+        if (Data[i] != 0xFF)
+            return false;
+    }
+    return true;
+}
+
+bool HighScoreManager::ReadHeader(int Page, uint32_t * PageGeneration){
+    ScoreLogHeader header;
+    memcpy(&header, GetLogPage(Page), sizeof(header));
+
+    if (header.Magic != SCORE_LOG_MAGIC || Crc32((const uint8_t *)&header, offsetof(ScoreLogHeader, Crc)) != header.Crc)
+        return false;
+
+    *PageGeneration = header.Generation;
+    return true;
+}
+
+bool HighScoreManager::DecodeRecord(const uint8_t * Slot, ScoreRecord * Record){
+    // An empty slot would otherwise pass as a record with a CRC of 0xFFFFFFFF if the CRC happened to match.
+    if (IsBlank(Slot, sizeof(ScoreRecord)))
+        return false;
+
+    memcpy(Record, Slot, sizeof(ScoreRecord));
+
+    return Crc32((const uint8_t *)Record, offsetof(ScoreRecord, Crc)) == Record->Crc;
+}
+
+bool HighScoreManager::IsCurrentEntry(const ScoreRecord * Record){
+    return (Record->Flags & RECORD_HAS_ENTRY) && Record->Epoch == Epoch && Record->Id < NumberOfEntries;
+}
+
+void HighScoreManager::WriteWords(uint8_t * Address, const void * Data, int Length){
+    const uint8_t * bytes = (const uint8_t *)Data;
+
+    for (int i = 0; i < Length; i += 4){
+        uint32_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        mpuBit->storage.flashWordWrite((uint32_t *)(Address + i), word);
+    }
+}
+
+bool HighScoreManager::WriteRecord(ScoreRecord * Record){
+    if (!LogFits)
+        return false;
+
+    // Nothing written yet, or the page in use is full.
+    if (ActivePage < 0 || NextSlot >= GetSlotCount()){
+        if (!Compact() || NextSlot >= GetSlotCount())
+            return false;
+    }
+
+    Record->Sequence = Sequence + 1;
+    Record->Crc = Crc32((const uint8_t *)Record, offsetof(ScoreRecord, Crc));
+
+    // The one and only flash write for the change, appended after everything else so nothing is erased.
+    uint8_t * slot = GetSlot(ActivePage, NextSlot);
+    NextSlot++;
+    WriteWords(slot, Record, sizeof(ScoreRecord));
+
+    // Check it made it, a slot that doesn't read back is left for recovery to skip.
+    ScoreRecord check;
+    if (!DecodeRecord(slot, &check) || check.Sequence != Record->Sequence)
+        return false;
+
+    Sequence = Record->Sequence;
+    return true;
+}
+
+bool HighScoreManager::Compact(){
+    int page = ActivePage < 0 ? 0 : (ActivePage + 1) % SCORE_LOG_PAGES;
+
+    mpuBit->storage.flashPageErase((uint32_t *)GetLogPage(page));
+
+    // Only the current history comes across, anything from before a Reset is dropped.
+    int slot = 1;
+    if (ActivePage >= 0){
+        for (int i = 1; i < NextSlot; i++){
+            ScoreRecord record;
+            if (DecodeRecord(GetSlot(ActivePage, i), &record) && IsCurrentEntry(&record)){
+                WriteWords(GetSlot(page, slot), &record, sizeof(record));
+                slot++;
+            }
+        }
+    }
+
+    // The copied scores keep their old sequence numbers, this brings the header along as the newest record.
+    ScoreRecord checkpoint;
+    memset(&checkpoint, 0, sizeof(checkpoint));
+    checkpoint.Sequence = Sequence + 1;
+    checkpoint.Epoch = Epoch;
+    checkpoint.NumberOfEntries = NumberOfEntries;
+    checkpoint.BestTimeID = BestTimeID;
+    checkpoint.BestTime = BestTime;
+    checkpoint.Crc = Crc32((const uint8_t *)&checkpoint, offsetof(ScoreRecord, Crc));
+    WriteWords(GetSlot(page, slot), &checkpoint, sizeof(checkpoint));
+    slot++;
+
+    // Written last, the page isn't used until this is there.
+    ScoreLogHeader header;
+    header.Magic = SCORE_LOG_MAGIC;
+    header.Generation = ActivePage < 0 ? 1 : Generation + 1;
+    header.Crc = Crc32((const uint8_t *)&header, offsetof(ScoreLogHeader, Crc));
+    WriteWords(GetLogPage(page), &header, sizeof(header));
+
+    uint32_t check;
+    if (!ReadHeader(page, &check) || check != header.Generation)
+        return false;
+
+    ActivePage = page;
+    Generation = header.Generation;
+    Sequence = checkpoint.Sequence;
+    NextSlot = slot;
+
+    return true;
+}
@@ -1,16 +1,88 @@
 #ifndef __HIGHSCOREMANAGER__
-#define __HGIHSCOREMANAGER__
+#define __HIGHSCOREMANAGER__
 #include "MicroBit.h"
 
+// A single score as read back from flash.
+struct ScoreEntry{
+    uint16_t Id;
+    uint8_t Mode;
+    uint32_t Time;
+};
+
+// Selects which entries ReadEntries returns. Entry IDs are given out in the order games are played,
+// so an ID range is also a range of when they were played.
+struct ScoreFilter{
+    // Zero matches every mode.
+    uint8_t Mode;
+    uint16_t FirstId;
+    uint16_t LastId;
+};
+
+// Set in ScoreRecord::Flags when the record carries a score.
+#define RECORD_HAS_ENTRY 0x01
+
+// Returned by AddEntry when the score couldn't be stored.
+#define SCORE_NO_ID 0xFFFF
+
+// The scores are kept as a log in two flash pages of their own, this many pages back from the end of the code
+// space and the one after it. They sit below the pages the runtime keeps for its storage and scratch space.
+#define SCORE_LOG_PAGE_OFFSET 22
+#define SCORE_LOG_PAGES 2
+
+// Where the program image ends in flash: the code, then the initial values of .data, which the linker script puts
+// straight after it. The log pages have to start above this. The host simulation supplies its own.
+#ifndef PROGRAM_IMAGE_END
+extern uint32_t __etext;
+extern uint32_t __data_start__;
+extern uint32_t __data_end__;
+#define PROGRAM_IMAGE_END ((uint32_t)&__etext + ((uint32_t)&__data_end__ - (uint32_t)&__data_start__))
+#endif
+
+// Marks a log page header.
+#define SCORE_LOG_MAGIC 0x53434F52
+
+// Everything one game changes, appended to the log as a single record so it all lands or none of it does.
+// The header fields are a snapshot taken after the change, so the newest valid record is the whole header.
+struct ScoreRecord{
+    uint32_t Sequence;
+    // Sequence number of the last Reset. Records from before it are ignored.
+    uint32_t Epoch;
+    uint32_t Time;
+    uint16_t Id;
+    uint16_t NumberOfEntries;
+    uint16_t BestTimeID;
+    uint8_t Mode;
+    uint8_t Flags;
+    uint32_t BestTime;
+    // CRC32 of everything above.
+    uint32_t Crc;
+};
+
+// Held in the first record slot of a log page. It is written once the page has been filled from the other one, so
+// a page with a valid header is complete.
+struct ScoreLogHeader{
+    uint32_t Magic;
+    // Goes up each time the log moves to the other page, the page with the highest is the one in use.
+    uint32_t Generation;
+    // CRC32 of everything above.
+    uint32_t Crc;
+};
+
 class HighScoreManager{
 
     public:
     HighScoreManager();
     
-    // Populate member variables and calculate the average score
+    // Populate member variables from the newest valid record in the score log. Returns false if the log pages
+    // overlap the program image, and then they are never read or written.
     bool Initialise(MicroBit * uBit);
-    // Adds a new time to the highscores list.
-    uint16_t AddEntry(uint32_t Time);
+    // Holds a score in RAM until Commit is called. Only one score can be staged at a time.
+    bool Stage(uint32_t Time, uint8_t Mode = 0);
+    // Appends the staged score and the updated header to the log as one record.
+    bool Commit();
+    // Adds a new time to the highscores list. Returns its ID, or SCORE_NO_ID if it couldn't be stored (another score
+    // is already staged, the log is full, or it overlaps the program).
+    uint16_t AddEntry(uint32_t Time, uint8_t Mode = 0);
     // Resets the NumberOfEntries.
     bool Reset();
 
@@ -20,6 +92,10 @@ class HighScoreManager{
     int GetNumberOfEntries();
     // Gets the score corresponding with the provided ID
     bool GetScore(uint16_t Id, uint32_t * Time);
+    // Copies up to MaxEntries scores into Buffer in the order they are stored, starting from Cursor.
+    // Cursor should start at 0 and is moved on for the next call. Returns the number copied, 0 once there are no more.
+    // Reads straight from flash, nothing is allocated.
+    int ReadEntries(ScoreEntry * Buffer, int MaxEntries, int * Cursor, const ScoreFilter * Filter = NULL);
     // Gets the fastest time
     unsigned int GetBestTime();
     // Gets the current average reaction time.
@@ -28,11 +104,56 @@ class HighScoreManager{
     private:
     uint16_t NumberOfEntries;
     uint16_t BestTimeID;
+    uint32_t BestTime;
     double AverageTime;
     MicroBit * mpuBit;
+
+    // Sequence number of the newest record, and of the last Reset.
+    uint32_t Sequence;
+    uint32_t Epoch;
+
+    // The log page in use (-1 before anything has been written), its generation, and the next empty record slot.
+    int ActivePage;
+    uint32_t Generation;
+    int NextSlot;
+
+    // False if the log pages overlap the program image, or before Initialise.
+    bool LogFits;
+
+    bool Staged;
+    uint32_t StagedTime;
+    uint8_t StagedMode;
     // // Runs through all entries and caluclates the average time. 
     void CalculateAverage();
 
+    // Address of one of the log pages, and of a record slot in it. Slot 0 holds the page header.
+    uint8_t * GetLogPage(int Page);
+    uint8_t * GetSlot(int Page, int Slot);
+    int GetSlotCount();
+
+    // Returns true if the flash hasn't been written since it was erased.
+    bool IsBlank(const uint8_t * Data, int Length);
+
+    // Returns true if the page has a valid header, and gives its generation.
+    bool ReadHeader(int Page, uint32_t * PageGeneration);
+
+    // Copies the record out of a slot. Returns false if the slot is empty, torn or fails its CRC.
+    bool DecodeRecord(const uint8_t * Slot, ScoreRecord * Record);
+
+    // Returns true if the record holds a score that is part of the current history.
+    bool IsCurrentEntry(const ScoreRecord * Record);
+
+    // Programs Length bytes (a multiple of 4) one word at a time. Nothing is erased.
+    void WriteWords(uint8_t * Address, const void * Data, int Length);
+
+    // Fills in the sequence number and CRC and appends the record to the log, moving the log to the other page
+    // first if this one is full.
+    bool WriteRecord(ScoreRecord * Record);
+
+    // Erases the other page, copies the current scores and a record of the header into it, then writes its page
+    // header. Until that last write the old page is still the one in use.
+    bool Compact();
+
     // // Gets the ID of the highest score from flash.
     // void GetHighestScore();
 
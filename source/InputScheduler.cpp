@@ -0,0 +1,203 @@
+#include "InputScheduler.h"
+
+const char * PhaseNames[] = {"IDLE", "COUNTDOWN", "STIMULUS"};
+
+
+InputScheduler::InputScheduler() : mpIOManager(NULL), mpPolicy(NULL), Phase(PhaseIdle), PhaseStart(0), State(0), Presses(0), SampleTime(0) {
+    for (int i = 0; i < 8; i++){
+        PressTimes[i] = 0;
+    }
+    ResetStats();
+}
+
+void InputScheduler::Init(GPIOManager * ioManager){
+    mpIOManager = ioManager;
+    PhaseStart = us_ticker_read();
+}
+
+void InputScheduler::SetPolicy(const SchedulerPolicy * policy){
+    mpPolicy = policy;
+}
+
+void InputScheduler::SetPhase(InputPhase phase){
+    uint32_t now = us_ticker_read();
+
+    // Close off the time spent in the old phase.
+    Stats[Phase].Time += now - PhaseStart;
+    PhaseStart = now;
+    Phase = phase;
+}
+
+bool InputScheduler::Poll(){
+    const PhasePolicy & policy = mpPolicy->Phases[Phase];
+
+    bool due = policy.SamplePeriod != SCHEDULER_NO_POLL && us_ticker_read() - SampleTime >= policy.SamplePeriod;
+    if (!due && policy.UseInterrupt)
+        due = mpIOManager->InputPending();
+
+    if (!due)
+        return false;
+
+    SampleTime = us_ticker_read();
+    char value = Sample();
+    char pressed = value & ~State;
+    char seen = pressed;
+    SetPressTimes(pressed, SampleTime);
+
+    // New presses have to still be there after the confirmation burst. A button that first shows up during the
+    // burst is just as new, the reads clear the expander's interrupt so nothing else would pick it up until the
+    // next sample. It's timed from the read that saw it, and the burst carries on until it has been confirmed too.
+    int confirmed = 0;
+    while (pressed && confirmed < policy.ConfirmReads){
+        uint32_t readTime = us_ticker_read();
+        char burst = Sample();
+        char arrived = burst & ~State & ~seen;
+
+        pressed = (pressed & burst) | arrived;
+        seen |= arrived;
+        SetPressTimes(arrived, readTime);
+
+        confirmed = arrived ? 0 : confirmed + 1;
+    }
+
+    // Releases and existing presses are taken as they are, only new presses need confirming.
+    State = (value & State) | pressed;
+    Presses = pressed;
+
+    Stats[Phase].Samples++;
+    if (pressed)
+        Stats[Phase].Presses++;
+
+    return true;
+}
+
+char InputScheduler::GetState(){
+    return State;
+}
+
+char InputScheduler::GetPresses(){
+    return Presses;
+}
+
+uint32_t InputScheduler::GetPressTime(int pin){
+    return PressTimes[pin];
+}
+
+char InputScheduler::WaitForPress(){
+    while (!Poll() || !Presses){
+        // A replay that has nothing left to press would otherwise leave the game waiting forever.
+        if (mpIOManager->IsReplayStalled())
+            return 0;
+
+        Idle();
+    }
+    return State;
+}
+
+void InputScheduler::WaitForRelease(char mask){
+    while (State & mask){
+        Poll();
+        Idle();
+    }
+}
+
+char InputScheduler::Wait(uint32_t time){
+    uint32_t start = us_ticker_read();
+
+    while (us_ticker_read() - start < time){
+        if (Poll() && Presses)
+            return Presses;
+        Idle(start + time);
+    }
+    return 0;
+}
+
+void InputScheduler::Idle(){
+    SCHEDULE_UNTIL(NextDue());
+}
+
+void InputScheduler::Idle(uint32_t until){
+    SCHEDULE_UNTIL(Earliest(until, NextDue()));
+}
+
+void InputScheduler::ResetStats(){
+    for (int i = 0; i < PhaseCount; i++){
+        Stats[i].Time = 0;
+        Stats[i].Samples = 0;
+        Stats[i].Reads = 0;
+        Stats[i].BusyTime = 0;
+        Stats[i].Presses = 0;
+    }
+    PhaseStart = us_ticker_read();
+}
+
+PhaseStats InputScheduler::GetStats(InputPhase phase){
+    PhaseStats stats = Stats[phase];
+
+    // Include the time spent in the phase so far.
+    if (phase == Phase)
+        stats.Time += us_ticker_read() - PhaseStart;
+
+    return stats;
+}
+
+void InputScheduler::Send(MicroBit * uBit){
+    uBit->serial.send("POLICY:");
+    uBit->serial.send(mpPolicy->Name);
+    uBit->serial.send("\n\r");
+
+    for (int i = 0; i < PhaseCount; i++){
+        PhaseStats stats = GetStats((InputPhase)i);
+        if (stats.Time == 0)
+            continue;
+
+        uBit->serial.send(" ");
+        uBit->serial.send(PhaseNames[i]);
+        uBit->serial.send(" TIME(ms):");
+        uBit->serial.send((int)(stats.Time / 1000));
+        uBit->serial.send(" SAMPLES:");
+        uBit->serial.send((int)stats.Samples);
+        uBit->serial.send(" READS:");
+        uBit->serial.send((int)stats.Reads);
+        uBit->serial.send(" BUSY(us):");
+        uBit->serial.send((int)stats.BusyTime);
+        // Share of the phase spent on the bus, in tenths of a percent.
+        uBit->serial.send(" UTIL(0.1%):");
+        uBit->serial.send((int)((uint64_t)stats.BusyTime * 1000 / stats.Time));
+        uBit->serial.send(" PRESSES:");
+        uBit->serial.send((int)stats.Presses);
+        uBit->serial.send("\n\r");
+    }
+}
+
+uint32_t InputScheduler::NextDue(){
+    const PhasePolicy & policy = mpPolicy->Phases[Phase];
+    uint32_t due = mpIOManager->GetNextChange();
+
+    if (policy.SamplePeriod != SCHEDULER_NO_POLL)
+        due = Earliest(due, SampleTime + policy.SamplePeriod);
+
+    return due;
+}
+
+uint32_t InputScheduler::Earliest(uint32_t a, uint32_t b){
+    return (int32_t)(a - b) < 0 ? a : b;
+}
+
+void InputScheduler::SetPressTimes(char pressed, uint32_t time){
+    for (int i = 0; i < 8; i++){
+        if (pressed & (1 << i))
+            PressTimes[i] = time;
+    }
+}
+
+char InputScheduler::Sample(){
+    BusStats before = mpIOManager->GetBusStats();
+    char value = mpIOManager->ReadPortB();
+    BusStats after = mpIOManager->GetBusStats();
+
+    Stats[Phase].Reads++;
+    Stats[Phase].BusyTime += after.BusyTime - before.BusyTime;
+
+    return value;
+}
@@ -0,0 +1,121 @@
+#ifndef __INPUTSCHEDULER__
+#define __INPUTSCHEDULER__
+#include "MicroBit.h"
+#include "GPIOManager.h"
+
+// Sample period that turns off periodic sampling, leaving just the interrupt.
+#define SCHEDULER_NO_POLL 0xFFFFFFFF
+
+// Spin loops hand over to the other fibers with this, saying when they next have anything to do. The time isn't
+// even worked out on the device, the host simulation supplies its own to skip ahead to it.
+#ifndef SCHEDULE_UNTIL
+#define SCHEDULE_UNTIL(time) schedule()
+#endif
+
+enum InputPhase{
+    // Menus and anything else waiting on a person.
+    PhaseIdle,
+    // Before the stimulus, presses here are jump starts.
+    PhaseCountdown,
+    // Waiting for the response to a stimulus.
+    PhaseStimulus,
+    PhaseCount
+};
+
+// How input is sampled during one phase.
+struct PhasePolicy{
+    // Time between reads of port B (us). Zero reads on every poll, as fast as the bus allows.
+    uint32_t SamplePeriod;
+    // Read as soon as the expander raises its interrupt (P8).
+    bool UseInterrupt;
+    // Extra reads a new press has to survive before it counts.
+    int ConfirmReads;
+};
+
+struct SchedulerPolicy{
+    const char * Name;
+    PhasePolicy Phases[PhaseCount];
+};
+
+// Where the bus time went during one phase.
+struct PhaseStats{
+    uint32_t Time;
+    uint32_t Samples;
+    uint32_t Reads;
+    uint32_t BusyTime;
+    uint32_t Presses;
+};
+
+class InputScheduler{
+    public:
+    InputScheduler();
+
+    void Init(GPIOManager * ioManager);
+
+    void SetPolicy(const SchedulerPolicy * policy);
+
+    void SetPhase(InputPhase phase);
+
+    // Samples port B if the current phase's policy says one is due. Returns true if it did.
+    bool Poll();
+
+    // The buttons currently held, as of the last sample.
+    char GetState();
+
+    // The buttons that went down at the last sample.
+    char GetPresses();
+
+    // When the button on pin went down, the time of the read that first saw it. Only meaningful while it's held.
+    uint32_t GetPressTime(int pin);
+
+    // Keeps sampling until something is pressed and returns the buttons held.
+    // Returns 0 if a replay stalls before anything is pressed.
+    char WaitForPress();
+
+    // Keeps sampling until none of the buttons in mask are held.
+    void WaitForRelease(char mask);
+
+    // Samples for the given time (us), returning early with anything pressed. Returns 0 if nothing was.
+    char Wait(uint32_t time);
+
+    // Hands over to the other fibers from a loop that is waiting on Poll. With until, the loop also has something
+    // of its own to do then.
+    void Idle();
+    void Idle(uint32_t until);
+
+    void ResetStats();
+
+    PhaseStats GetStats(InputPhase phase);
+
+    // Sends the policy and how each phase used the bus over serial.
+    void Send(MicroBit * uBit);
+
+    private:
+    GPIOManager * mpIOManager;
+    const SchedulerPolicy * mpPolicy;
+
+    InputPhase Phase;
+    uint32_t PhaseStart;
+
+    char State;
+    char Presses;
+    uint32_t SampleTime;
+    uint32_t PressTimes[8];
+
+    PhaseStats Stats[PhaseCount];
+
+    // Reads port B, counting the bus time against the current phase.
+    char Sample();
+
+    // When Poll could next have something to do: a sample falling due, or port B changing on its own.
+    uint32_t NextDue();
+
+    // Whichever of the two times comes first.
+    uint32_t Earliest(uint32_t a, uint32_t b);
+
+    // Times every button in pressed from the read taken at time.
+    void SetPressTimes(char pressed, uint32_t time);
+
+};
+
+#endif
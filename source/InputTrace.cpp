@@ -0,0 +1,84 @@
+#include "InputTrace.h"
+
+
+InputTrace::InputTrace() : Length(0), GameMode(0), Option(0), Seed(0) {
+    for (int i = 0; i < 8; i++){
+        Pairing[i] = 0;
+    }
+}
+
+void InputTrace::Begin(int gameMode, uint32_t seed){
+    Length = 0;
+    GameMode = gameMode;
+    Option = 0;
+    Seed = seed;
+}
+
+void InputTrace::SetOption(int option){
+    Option = option;
+}
+
+int InputTrace::Add(uint8_t ledPin, uint8_t inputPin, uint32_t delay, uint8_t window){
+    if (Length >= TRACE_LENGTH)
+        return -1;
+
+    Events[Length].Delay = delay;
+    Events[Length].LEDPin = ledPin;
+    Events[Length].InputPin = inputPin;
+    Events[Length].Window = window;
+    Length++;
+
+    return Length - 1;
+}
+
+void InputTrace::SetPairing(uint8_t ledPin, uint8_t inputPin){
+    Pairing[ledPin] = inputPin;
+}
+
+uint8_t InputTrace::GetPairing(uint8_t ledPin){
+    return Pairing[ledPin];
+}
+
+TraceEvent * InputTrace::GetEvent(int index){
+    return &Events[index];
+}
+
+int InputTrace::GetLength(){
+    return Length;
+}
+
+int InputTrace::GetGameMode(){
+    return GameMode;
+}
+
+int InputTrace::GetOption(){
+    return Option;
+}
+
+uint32_t InputTrace::GetSeed(){
+    return Seed;
+}
+
+void InputTrace::Send(MicroBit * uBit){
+    // Header line followed by one "LED,Input,Delay,Window" line per stimulus or early press, in the order they happened.
+    uBit->serial.send("TRACE:");
+    uBit->serial.send(GameMode);
+    uBit->serial.send(",");
+    uBit->serial.send(Option);
+    uBit->serial.send(",");
+    uBit->serial.send((int)Seed);
+    uBit->serial.send(",");
+    uBit->serial.send(Length);
+    uBit->serial.send("\n\r");
+
+    for (int i = 0; i < Length; i++){
+        uBit->serial.send((int)Events[i].LEDPin);
+        uBit->serial.send(",");
+        uBit->serial.send((int)Events[i].InputPin);
+        uBit->serial.send(",");
+        uBit->serial.send((int)Events[i].Delay);
+        uBit->serial.send(",");
+        uBit->serial.send((int)Events[i].Window);
+        uBit->serial.send("\n\r");
+    }
+}
@@ -0,0 +1,79 @@
+#ifndef __INPUTTRACE__
+#define __INPUTTRACE__
+#include "MicroBit.h"
+
+// Maximum number of stimuli that can be held in a trace, no more than 64 as a replay keeps a bit for each.
+#define TRACE_LENGTH 64
+
+// How long a replayed button is held down for before it is released (us).
+#define TRACE_HOLD_TIME 50000
+
+// Delay of a stimulus nobody responded to.
+#define TRACE_NO_RESPONSE 0xFFFFFFFF
+
+// Pin used by made up events. The event goes with whichever LED lights next and presses the input paired with it.
+#define TRACE_ANY_PIN 0xFF
+
+// LED pin of a press made before its stimulus (a jump or false start). Its Delay is from the start of the window
+// it was pressed in.
+#define TRACE_EARLY_PIN 0xFE
+
+// Stimuli lit this close together in the trace can be replayed in either order, e.g. two players whose LEDs light
+// within the replay's timing error of each other.
+#define TRACE_REORDER_WINDOW 4
+
+// A replay that hasn't pressed anything for this long is given up on (us).
+#define TRACE_STALL_TIME 10000000
+
+// One stimulus, in the order the LEDs were lit. The press happens Delay us after LEDPin was lit.
+struct TraceEvent{
+    uint32_t Delay;
+    uint8_t LEDPin;
+    uint8_t InputPin;
+    // For early presses, which window they were made in, counting from 0 in the order the game opened them.
+    uint8_t Window;
+};
+
+class InputTrace{
+    public:
+    InputTrace();
+
+    // Empties the trace and records which game and random seed it belongs to.
+    void Begin(int gameMode, uint32_t seed);
+
+    // Anything chosen before the game started (e.g. the number of players) that a replay needs.
+    void SetOption(int option);
+
+    // Appends a stimulus, or an early press, to the trace. Returns its index, or -1 if the trace is full.
+    int Add(uint8_t ledPin, uint8_t inputPin, uint32_t delay, uint8_t window = 0);
+
+    // Which input a made up event presses when the given LED lights.
+    void SetPairing(uint8_t ledPin, uint8_t inputPin);
+
+    uint8_t GetPairing(uint8_t ledPin);
+
+    TraceEvent * GetEvent(int index);
+
+    int GetLength();
+
+    int GetGameMode();
+
+    int GetOption();
+
+    uint32_t GetSeed();
+
+    // Writes the trace out over serial so it can be stored off the device.
+    void Send(MicroBit * uBit);
+
+    private:
+    TraceEvent Events[TRACE_LENGTH];
+    int Length;
+    int GameMode;
+    int Option;
+    uint32_t Seed;
+
+    uint8_t Pairing[8];
+
+};
+
+#endif
@@ -1,6 +1,9 @@
 #include "MicroBit.h"
 #include "HighScoreManager.h"
 #include "GPIOManager.h"
+#include "InputTrace.h"
+#include "DisplayPresenter.h"
+#include "InputScheduler.h"
 
 // Shortcut for finding how big an array is
 #define DIM(x) sizeof(x) / sizeof(x[0])
@@ -14,6 +17,15 @@ HighScoreManager Highscores;
 // Manages interaction with external GPIO MCP23017 via i2c
 GPIOManager IOManager;
 
+// Plays results on the display without holding up the games.
+DisplayPresenter Presenter;
+
+// Decides when the buttons are read, depending on what the game is doing.
+InputScheduler Scheduler;
+
+// Responses from the last game played, so that it can be replayed through the hidden replay mode.
+InputTrace Trace;
+
 // Structure for pairing up which IO refer to which buttons.
 struct ButtonStruct
 {
@@ -32,21 +44,152 @@ const ButtonStruct Buttons[] = {
     {4, 1},
     {6, 0}};
 
+// Every input on port B, for waiting until nothing at all is held.
+#define ALL_INPUTS 0xFF
+
+// Rounds in Vs mode.
+#define VERSUS_ROUNDS 5
+
+// Number of stimuli each player gets in the multi player mode.
+#define MULTI_ROUNDS 5
+#define MULTI_MAX_PLAYERS 4
+
+// A press before the player's LED is lit adds this to their total (us).
+#define MULTI_FALSE_START_PENALTY 100000
+
+// A stimulus nobody responds to is counted as this reaction time (us).
+#define MULTI_TIMEOUT 2000000
+
+// Best time of a player who never pressed in time.
+#define MULTI_NO_BEST 0xFFFFFFFF
+
+// Sent with the replay metrics, indexed by ReplayStatus.
+const char * const ReplayStatusNames[] = {"OK", "ENDED", "DIVERGED", "STALLED"};
+
+// Per player results in the multi player mode.
+struct PlayerStats
+{
+    int Reactions;
+    uint32_t Sum;
+    uint32_t Best;
+    int FalseStarts;
+};
+
+// Pins used by the loopback benchmark, port A pin 7 should be wired to port B pin 7. Neither is used by the buttons.
+const ButtonStruct LoopbackPins = {7, 7};
+
+// Number of edges generated for each loopback run.
+#define LOOPBACK_EDGES 2000
+
+// Give up waiting for an edge after this long (us).
+#define LOOPBACK_TIMEOUT 10000
+
+// Latency histogram, anything past the last bucket goes into an overflow bucket.
+#define LOOPBACK_BUCKET_WIDTH 100
+#define LOOPBACK_BUCKETS 32
+
 enum GameModes
 {
     ReactionTime = 0x01,
     ButtonCount = 0x02,
-    Versus = 0x03
+    Versus = 0x03,
+    MultiPlayer = 0x04,
+    // Hidden modes, only reachable while button B on the micro:bit is held.
+    Replay = 0x05,
+    Loopback = 0x06
+};
+
+// Input sampling for each phase (idle, countdown, stimulus) as {sample period (us), use the interrupt, confirmation reads}.
+// Not static, so the host bench can play games under each of them.
+extern const SchedulerPolicy BusyPollPolicy;
+extern const SchedulerPolicy InterruptPolicy;
+extern const SchedulerPolicy PhasedPolicy;
+extern const SchedulerPolicy ThroughputPolicy;
+
+// Reads as fast as the bus allows all the time, which is how the games used to work.
+const SchedulerPolicy BusyPollPolicy = {"BUSYPOLL", {{0, false, 0}, {0, false, 0}, {0, false, 0}}};
+
+// Only reads when the expander raises its interrupt.
+const SchedulerPolicy InterruptPolicy = {"INTERRUPT", {{SCHEDULER_NO_POLL, true, 0}, {SCHEDULER_NO_POLL, true, 0}, {SCHEDULER_NO_POLL, true, 0}}};
+
+// Slow sampling in menus, the interrupt backed up by a poll during countdowns, and the interrupt plus a
+// confirmation burst while waiting on a stimulus.
+const SchedulerPolicy PhasedPolicy = {"PHASED", {{20000, false, 0}, {5000, true, 0}, {10000, true, 2}}};
+
+// Phased without the confirmation burst, for when presses come thick and fast.
+const SchedulerPolicy ThroughputPolicy = {"THROUGHPUT", {{20000, false, 0}, {5000, true, 0}, {10000, true, 0}}};
+
+// Input policy used by each game mode, indexed by GameModes.
+const SchedulerPolicy * const GamePolicies[] = {
+    &PhasedPolicy,     // Unused
+    &PhasedPolicy,     // ReactionTime
+    &ThroughputPolicy, // ButtonCount
+    &PhasedPolicy,     // Versus
+    &PhasedPolicy      // MultiPlayer
 };
 
 // Test average reaction times
-void ReactionTimerGame();
+int ReactionTimerGame();
 
 // How many buttons can be pressed in the time.
-void ButtonCountGame();
+int ButtonCountGame();
 
 // Two player vs mode
-void VersusGame();
+int VersusGame();
+
+// Up to four players, each with their own button and their own stimulus timing.
+int MultiPlayerGame(int players);
+
+// Lets the players choose how many of them are playing.
+int SelectPlayerCount();
+
+// Runs the given game and returns its result. The option is anything chosen before the game starts.
+int PlayGame(int mode, int option);
+
+// Plays the game, recording it so that it can be replayed later. Uses the game's own input policy unless another is given.
+int RecordGame(int mode, int option, uint32_t seed, const SchedulerPolicy * policy = NULL);
+
+// Plays the last recorded trace back through the game it was recorded from.
+void ReplayGame();
+
+// Plays the trace and returns the game's result. Uses the game's own input policy unless another is given.
+int ReplayTrace(const SchedulerPolicy * policy = NULL);
+
+// Replays the same made up game with each input policy, to compare their bus use and detection latency.
+void PolicyBenchmark();
+
+// Waits for the given time (us) and returns any of the buttons in mask pressed in the meantime.
+char WaitForJumpStart(uint32_t time, char mask);
+
+// Replays made up multi player games from one player up to four, to show the timing holds up.
+void MultiPlayerSweep();
+
+// Fills the trace with made up responses, generated from the seed. Each one goes with whichever LED lights next.
+// Vs mode games get the odd jump start as well.
+void SynthesiseTrace(int mode, int option, uint32_t seed);
+
+// Sends the bus and replay statistics for the game just played over serial.
+void SendMetrics(int mode, int result);
+
+// Checks for a command sent over serial. d dumps the scores, b times reading them back, t sends the last trace,
+// m runs the multi player sweep, p compares the input policies. Returns true if the command played anything, so
+// the menu has to be put back.
+bool HandleSerialCommand();
+
+// Lights the menu buttons and samples the inputs for a person choosing.
+void ShowMenu();
+
+// Sends every stored score over serial.
+void DumpScores();
+
+// Compares streaming every score against looking each one up.
+void BenchmarkScores();
+
+// Measures the input pipeline through a wire from an output to an input, then through a modelled wire.
+void LoopbackBenchmark();
+
+// Runs one set of loopback measurements and sends the summary over serial.
+void RunLoopback(const char * label);
 
 // Entry point for the program.
 int main()
@@ -57,12 +200,18 @@ int main()
     // Wait for external devices to power up
     wait_ms(5000);
 
-    // Read the header information & calculate averages.
-    Highscores.Initialise(&uBit);
+    // Read the header information & calculate averages. False if the program has grown into the score log's pages,
+    // and then no scores are saved.
+    bool scoresKept = Highscores.Initialise(&uBit);
 
     // Setup the GPIO expander for buttons
     IOManager.Init(&uBit);
 
+    // Start playing anything sent to the display.
+    Presenter.Init(&uBit);
+
+    Scheduler.Init(&IOManager);
+
     // Check to see if button 2 is being held during startup.
     // This wil erase flash.
     if (IOManager.ReadPortB())
@@ -77,6 +226,11 @@ int main()
     // Set all the outputs to be off.
     IOManager.writeRegister(0x09, 0x00);
 
+    if (!scoresKept)
+    {
+        uBit.serial.send("SCORE LOG OVERLAPS PROGRAM\n\r");
+    }
+
     wait_ms(200);
 
     // Set default gamemode
@@ -86,21 +240,42 @@ int main()
     while (1)
     {
 
+        ShowMenu();
+
         // Select the game mode that we want to play.
         while (1)
         {
+            // The multi player sweep and policy comparison play games of their own.
+            if (HandleSerialCommand())
+            {
+                ShowMenu();
+            }
 
-            // Light up all the buttons on the main menu
-            IOManager.digitalWrite(Buttons[0].LEDPin, true);
-            IOManager.digitalWrite(Buttons[2].LEDPin, true);
-            IOManager.digitalWrite(Buttons[4].LEDPin, true);
-
-            // Update the display to show the currently selected mode.
-            uBit.display.print(modeSelect);
+            // Only do anything when the idle policy says it is time for a sample.
+            if (!Scheduler.Poll())
+            {
+                Scheduler.Idle();
+                continue;
+            }
 
             // Mode selection uses Button 1 and Button 5 (Most left and Most right) buttons.
             // The white button (button 3) confirms the selection.
-            char inputFlag = IOManager.ReadPortB();
+            char inputFlag = Scheduler.GetState();
+
+            // Results from the last game are still playing, any new press cuts them short.
+            if (Presenter.IsBusy())
+            {
+                if (Scheduler.GetPresses())
+                {
+                    Presenter.Skip();
+                    Scheduler.WaitForRelease(ALL_INPUTS);
+                }
+                Scheduler.Idle();
+                continue;
+            }
+
+            // Update the display to show the currently selected mode.
+            uBit.display.print(modeSelect);
 
             // Which button was pressed
             if (IOManager.isBitSetExclusive(inputFlag, Buttons[0].InputPin))
@@ -111,19 +286,18 @@ int main()
                     modeSelect--;
                 }
                 // Wait until they let go of the button.
-                while (IOManager.ReadPortB())
-                    ;
+                Scheduler.WaitForRelease(ALL_INPUTS);
             }
             else if (IOManager.isBitSetExclusive(inputFlag, Buttons[4].InputPin))
             {
                 // Right Button
-                if (modeSelect != 3)
+                int lastMode = uBit.buttonB.isPressed() ? GameModes::Loopback : GameModes::MultiPlayer;
+                if (modeSelect < lastMode)
                 {
                     modeSelect++;
                 }
                 // Wait until they let go of the button.
-                while (IOManager.ReadPortB())
-                    ;
+                Scheduler.WaitForRelease(ALL_INPUTS);
             }
             else if (IOManager.isBitSetExclusive(inputFlag, Buttons[2].InputPin))
             {
@@ -131,8 +305,7 @@ int main()
                 IOManager.writeRegister(0x09, 0x00);
 
                 // Wait until they let go of the button.
-                while (IOManager.ReadPortB())
-                    ;
+                Scheduler.WaitForRelease(ALL_INPUTS);
 
                 // Exit the loop
                 break;
@@ -143,15 +316,38 @@ int main()
         switch (modeSelect)
         {
         case GameModes::ReactionTime:
-            ReactionTimerGame();
+        case GameModes::ButtonCount:
+        case GameModes::Versus:
+        case GameModes::MultiPlayer:
+        {
+            int option = 0;
+            if (modeSelect == GameModes::MultiPlayer)
+            {
+                option = SelectPlayerCount();
+            }
+
+            int result = RecordGame(modeSelect, option, us_ticker_read());
+
+            SendMetrics(modeSelect, result);
+
+            if (modeSelect == GameModes::ReactionTime)
+            {
+                // The log is full (reset it by holding button 2 at start up), or it couldn't be written.
+                if (Highscores.AddEntry(result, modeSelect) == SCORE_NO_ID)
+                {
+                    uBit.serial.send("SCORE NOT SAVED\n\r");
+                    Presenter.ShowGlyph('!', 1000);
+                }
+            }
             wait_ms(300);
             break;
-        case GameModes::ButtonCount:
-            ButtonCountGame();
+        }
+        case GameModes::Replay:
+            ReplayGame();
             wait_ms(300);
             break;
-        case GameModes::Versus:
-            VersusGame();
+        case GameModes::Loopback:
+            LoopbackBenchmark();
             wait_ms(300);
             break;
         default:
@@ -167,9 +363,453 @@ int main()
     release_fiber();
 }
 
-void ReactionTimerGame()
+int PlayGame(int mode, int option)
+{
+    switch (mode)
+    {
+    case GameModes::ReactionTime:
+        return ReactionTimerGame();
+    case GameModes::ButtonCount:
+        return ButtonCountGame();
+    case GameModes::Versus:
+        return VersusGame();
+    case GameModes::MultiPlayer:
+        return MultiPlayerGame(option);
+    default:
+        return 0;
+    }
+}
+
+int RecordGame(int mode, int option, uint32_t seed, const SchedulerPolicy * policy)
+{
+    if (policy == NULL)
+    {
+        policy = GamePolicies[mode];
+    }
+
+    Trace.Begin(mode, seed);
+    Trace.SetOption(option);
+    srand(seed);
+
+    IOManager.ResetStats();
+    Scheduler.SetPolicy(policy);
+    Scheduler.ResetStats();
+    IOManager.StartRecording(&Trace);
+    int result = PlayGame(mode, option);
+    IOManager.StopTrace();
+
+    return result;
+}
+
+void ReplayGame()
+{
+    // Nothing has been recorded yet, so make something up.
+    if (Trace.GetLength() == 0)
+    {
+        SynthesiseTrace(GameModes::ReactionTime, 0, us_ticker_read());
+    }
+
+    int result = ReplayTrace();
+
+    SendMetrics(GameModes::Replay, result);
+}
+
+int ReplayTrace(const SchedulerPolicy * policy)
+{
+    if (policy == NULL)
+    {
+        policy = GamePolicies[Trace.GetGameMode()];
+    }
+
+    // Use the same seed so the game picks the same buttons as when it was recorded.
+    srand(Trace.GetSeed());
+
+    IOManager.ResetStats();
+    Scheduler.SetPolicy(policy);
+    Scheduler.ResetStats();
+    IOManager.StartReplay(&Trace);
+    int result = PlayGame(Trace.GetGameMode(), Trace.GetOption());
+    IOManager.StopTrace();
+
+    return result;
+}
+
+void MultiPlayerSweep()
+{
+    // This replaces whatever trace was recorded last.
+    for (int players = 1; players <= MULTI_MAX_PLAYERS; players++)
+    {
+        SynthesiseTrace(GameModes::MultiPlayer, players, us_ticker_read());
+        int result = ReplayTrace();
+        SendMetrics(GameModes::MultiPlayer, result);
+    }
+}
+
+void PolicyBenchmark()
+{
+    const SchedulerPolicy * policies[] = {&BusyPollPolicy, &InterruptPolicy, &PhasedPolicy, &ThroughputPolicy};
+
+    // Every policy gets the same game. The replay error is how long each one took to see the press.
+    SynthesiseTrace(GameModes::ReactionTime, 0, us_ticker_read());
+    for (unsigned int i = 0; i < DIM(policies); i++)
+    {
+        int result = ReplayTrace(policies[i]);
+        SendMetrics(GameModes::Replay, result);
+    }
+}
+
+void SynthesiseTrace(int mode, int option, uint32_t seed)
+{
+    Trace.Begin(mode, seed);
+    Trace.SetOption(option);
+    srand(seed);
+
+    // Made up responses press whichever button goes with the LED that lit.
+    for (unsigned int i = 0; i < DIM(Buttons); i++)
+    {
+        Trace.SetPairing(Buttons[i].LEDPin, Buttons[i].InputPin);
+    }
+
+    // Now and then someone in Vs mode jumps the start, partway through that round's countdown.
+    if (mode == GameModes::Versus)
+    {
+        // Either button on either side.
+        const int sides[] = {0, 1, 3, 4};
+
+        for (int round = 0; round < VERSUS_ROUNDS; round++)
+        {
+            if (rand() % 6 == 0)
+            {
+                uint32_t delay = (300 + rand() % 1200) * 1000;
+                Trace.Add(TRACE_EARLY_PIN, Buttons[sides[rand() % 4]].InputPin, delay, round);
+                continue;
+            }
+
+            // Both buttons light in a round that starts cleanly.
+            for (int led = 0; led < 2; led++)
+            {
+                Trace.Add(TRACE_ANY_PIN, TRACE_ANY_PIN, 150000 + (rand() % 250) * 1000);
+            }
+        }
+    }
+
+    // Fill the trace, a game that runs out of stimuli first just leaves the rest.
+    while (Trace.GetLength() < TRACE_LENGTH)
+    {
+        // Somewhere between 150 and 400ms
+        uint32_t delay = 150000 + (rand() % 250) * 1000;
+        Trace.Add(TRACE_ANY_PIN, TRACE_ANY_PIN, delay);
+    }
+}
+
+void SendMetrics(int mode, int result)
+{
+    BusStats bus = IOManager.GetBusStats();
+    ReplayStats replay = IOManager.GetReplayStats();
+
+    uBit.serial.send("MODE:");
+    uBit.serial.send(mode);
+    uBit.serial.send(" RESULT:");
+    uBit.serial.send(result);
+    uBit.serial.send("\n\r");
+
+    uBit.serial.send("BUS R:");
+    uBit.serial.send((int)bus.Reads);
+    uBit.serial.send(" W:");
+    uBit.serial.send((int)bus.Writes);
+    uBit.serial.send(" ERR:");
+    uBit.serial.send((int)bus.Errors);
+    uBit.serial.send(" BUSY(us):");
+    uBit.serial.send((int)bus.BusyTime);
+    uBit.serial.send("\n\r");
+
+    Scheduler.SetPhase(PhaseIdle);
+    Scheduler.Send(&uBit);
+
+    if (replay.Responses > 0)
+    {
+        uBit.serial.send("REPLAY N:");
+        uBit.serial.send((int)replay.Responses);
+        uBit.serial.send(" AVGERR(us):");
+        uBit.serial.send((int)(replay.TotalError / replay.Responses));
+        uBit.serial.send(" MAXERR(us):");
+        uBit.serial.send((int)replay.MaxError);
+        uBit.serial.send(" STATUS:");
+        uBit.serial.send(ReplayStatusNames[IOManager.GetReplayStatus()]);
+        uBit.serial.send("\n\r");
+
+        // Break it down by LED, so each player's timing can be checked on its own.
+        for (int i = 0; i < 8; i++)
+        {
+            ReplayStats led = IOManager.GetReplayStats(i);
+            if (led.Responses == 0)
+            {
+                continue;
+            }
+
+            uBit.serial.send(" LED:");
+            uBit.serial.send(i);
+            uBit.serial.send(" N:");
+            uBit.serial.send((int)led.Responses);
+            uBit.serial.send(" AVGERR(us):");
+            uBit.serial.send((int)(led.TotalError / led.Responses));
+            uBit.serial.send(" MAXERR(us):");
+            uBit.serial.send((int)led.MaxError);
+            uBit.serial.send(led.MaxError <= REPLAY_ERROR_BUDGET ? " OK" : " OVER");
+            uBit.serial.send("\n\r");
+        }
+    }
+}
+
+bool HandleSerialCommand()
+{
+    switch (uBit.serial.read(ASYNC))
+    {
+    case 'd':
+        DumpScores();
+        break;
+    case 'b':
+        BenchmarkScores();
+        break;
+    case 't':
+        Trace.Send(&uBit);
+        break;
+    case 'm':
+        MultiPlayerSweep();
+        return true;
+    case 'p':
+        PolicyBenchmark();
+        return true;
+    default:
+        break;
+    }
+    return false;
+}
+
+void ShowMenu()
+{
+    // Light up all the buttons on the main menu
+    IOManager.digitalWrite(Buttons[0].LEDPin, true);
+    IOManager.digitalWrite(Buttons[2].LEDPin, true);
+    IOManager.digitalWrite(Buttons[4].LEDPin, true);
+
+    Scheduler.SetPolicy(&PhasedPolicy);
+    Scheduler.SetPhase(PhaseIdle);
+}
+
+void DumpScores()
+{
+    ScoreEntry entries[8];
+    int cursor = 0;
+    int count = 0;
+
+    uBit.serial.send("SCORES:");
+    uBit.serial.send(Highscores.GetNumberOfEntries());
+    uBit.serial.send("\n\r");
+
+    // One "ID,Mode,Time" line per score.
+    while ((count = Highscores.ReadEntries(entries, DIM(entries), &cursor)) > 0)
+    {
+        for (int i = 0; i < count; i++)
+        {
+            uBit.serial.send(entries[i].Id);
+            uBit.serial.send(",");
+            uBit.serial.send(entries[i].Mode);
+            uBit.serial.send(",");
+            uBit.serial.send((int)entries[i].Time);
+            uBit.serial.send("\n\r");
+        }
+    }
+}
+
+void BenchmarkScores()
+{
+    ScoreEntry entries[8];
+    int cursor = 0;
+    int count = 0;
+    int streamed = 0;
+
+    uint32_t start = us_ticker_read();
+    while ((count = Highscores.ReadEntries(entries, DIM(entries), &cursor)) > 0)
+    {
+        streamed += count;
+    }
+    uint32_t streamTime = us_ticker_read() - start;
+
+    uint32_t time = 0;
+    int found = 0;
+
+    start = us_ticker_read();
+    for (int i = 0; i < Highscores.GetNumberOfEntries(); i++)
+    {
+        if (Highscores.GetScore(i, &time))
+        {
+            found++;
+        }
+    }
+    uint32_t lookupTime = us_ticker_read() - start;
+
+    uBit.serial.send("STREAM N:");
+    uBit.serial.send(streamed);
+    uBit.serial.send(" TIME(us):");
+    uBit.serial.send((int)streamTime);
+    uBit.serial.send("\n\r");
+
+    uBit.serial.send("GETSCORE N:");
+    uBit.serial.send(found);
+    uBit.serial.send(" TIME(us):");
+    uBit.serial.send((int)lookupTime);
+    uBit.serial.send("\n\r");
+}
+
+void LoopbackBenchmark()
+{
+    Presenter.Skip();
+    uBit.display.stopAnimation();
+    uBit.display.print('L');
+
+    // Everything off so only the loopback pin changes.
+    IOManager.writeRegister(0x09, 0x00);
+
+    RunLoopback("HW");
+
+    // Same again with the wire modelled, this shows how much of the latency is the bus and the code.
+    IOManager.StartLoopback(LoopbackPins.LEDPin, LoopbackPins.InputPin, 0);
+    RunLoopback("MODEL");
+    IOManager.StopLoopback();
+
+    IOManager.writeRegister(0x09, 0x00);
+    uBit.display.clear();
+}
+
+void RunLoopback(const char * label)
+{
+    uint16_t histogram[LOOPBACK_BUCKETS + 1] = {0};
+    uint32_t minLatency = 0xFFFFFFFF;
+    uint32_t maxLatency = 0;
+    uint32_t sum = 0;
+    uint32_t detected = 0;
+
+    bool value = false;
+    IOManager.digitalWrite(LoopbackPins.LEDPin, value);
+    wait_ms(10);
+
+    IOManager.ResetStats();
+
+    for (int i = 0; i < LOOPBACK_EDGES; i++)
+    {
+        value = !value;
+
+        // Time from starting the write to seeing the new level on the input.
+        uint32_t start = us_ticker_read();
+        IOManager.digitalWrite(LoopbackPins.LEDPin, value);
+
+        bool seen = false;
+        uint32_t latency = 0;
+        while (!seen && latency < LOOPBACK_TIMEOUT)
+        {
+            // Port B polarity is inverted, a high output reads back as 0.
+            seen = IOManager.digitalRead(LoopbackPins.InputPin) != value;
+            latency = us_ticker_read() - start;
+        }
+
+        if (!seen)
+        {
+            continue;
+        }
+
+        detected++;
+        sum += latency;
+        if (latency < minLatency)
+            minLatency = latency;
+        if (latency > maxLatency)
+            maxLatency = latency;
+
+        int bucket = latency / LOOPBACK_BUCKET_WIDTH;
+        histogram[bucket < LOOPBACK_BUCKETS ? bucket : LOOPBACK_BUCKETS]++;
+    }
+
+    BusStats bus = IOManager.GetBusStats();
+
+    // Toggle as fast as possible for a second without waiting for the input.
+    uint32_t toggles = 0;
+    uint32_t start = us_ticker_read();
+    while (us_ticker_read() - start < 1000000)
+    {
+        value = !value;
+        IOManager.digitalWrite(LoopbackPins.LEDPin, value);
+        toggles++;
+    }
+
+    // The same with a single register write, without digitalWrite reading the outputs first.
+    uint32_t directToggles = 0;
+    start = us_ticker_read();
+    while (us_ticker_read() - start < 1000000)
+    {
+        value = !value;
+        IOManager.writeRegister(0x09, value << LoopbackPins.LEDPin);
+        directToggles++;
+    }
+
+    uBit.serial.send("LOOPBACK ");
+    uBit.serial.send(label);
+    uBit.serial.send(" EDGES:");
+    uBit.serial.send(LOOPBACK_EDGES);
+    uBit.serial.send(" DETECTED:");
+    uBit.serial.send((int)detected);
+    uBit.serial.send("\n\r");
+
+    if (detected > 0)
+    {
+        uBit.serial.send("LATENCY(us) MIN:");
+        uBit.serial.send((int)minLatency);
+        uBit.serial.send(" AVG:");
+        uBit.serial.send((int)(sum / detected));
+        uBit.serial.send(" MAX:");
+        uBit.serial.send((int)maxLatency);
+        uBit.serial.send("\n\r");
+
+        // Percentiles are the top of the bucket they land in.
+        const int percentiles[] = {50, 90, 99};
+        for (unsigned int p = 0; p < DIM(percentiles); p++)
+        {
+            uint32_t target = (detected * percentiles[p] + 99) / 100;
+            uint32_t count = 0;
+            int bucket = 0;
+            while (bucket < LOOPBACK_BUCKETS && count + histogram[bucket] < target)
+            {
+                count += histogram[bucket];
+                bucket++;
+            }
+
+            uBit.serial.send("P");
+            uBit.serial.send(percentiles[p]);
+            uBit.serial.send(bucket < LOOPBACK_BUCKETS ? ":<" : ":>");
+            uBit.serial.send((bucket < LOOPBACK_BUCKETS ? bucket + 1 : bucket) * LOOPBACK_BUCKET_WIDTH);
+            uBit.serial.send(" ");
+        }
+        uBit.serial.send("\n\r");
+    }
+
+    uBit.serial.send("TOGGLES/S:");
+    uBit.serial.send((int)toggles);
+    uBit.serial.send(" DIRECT:");
+    uBit.serial.send((int)directToggles);
+    uBit.serial.send("\n\r");
+
+    uBit.serial.send("BUS R:");
+    uBit.serial.send((int)bus.Reads);
+    uBit.serial.send(" W:");
+    uBit.serial.send((int)bus.Writes);
+    uBit.serial.send(" ERR:");
+    uBit.serial.send((int)bus.Errors);
+    uBit.serial.send("\n\r");
+}
+
+int ReactionTimerGame()
 {
     // Clear anything off the display
+    Presenter.Skip();
     uBit.display.stopAnimation();
     uBit.display.clear();
 
@@ -196,17 +836,21 @@ void ReactionTimerGame()
 
         // Save the current time.
         uint32_t time1 = us_ticker_read();
+        Scheduler.SetPhase(PhaseStimulus);
 
         // Needs to loop for the case where the incorrect button is pressed.
         while (1)
         {
 
             // Wait for them to press the button
-            while (!uBit.io.P8.getDigitalValue())
-                ;
+            char inputFlag = Scheduler.WaitForPress();
 
-            // Check which input changed
-            char inputFlag = IOManager.ReadPortB();
+            // Only a replay that has run out of presses gets here with nothing pressed.
+            if (!inputFlag)
+            {
+                IOManager.digitalWrite(Buttons[currentButton].LEDPin, false);
+                return 0;
+            }
 
             // Check if the chosen pin was pressed
             if (IOManager.isBitSetExclusive(inputFlag, Buttons[currentButton].InputPin))
@@ -214,11 +858,12 @@ void ReactionTimerGame()
                 // They have pressed the correct button.
 
                 // Calculate the time it took for the button to be pressed, add it to the current total
-                sum += (us_ticker_read() - time1);
+                uint32_t reaction = Scheduler.GetPressTime(Buttons[currentButton].InputPin) - time1;
+                sum += reaction;
+                IOManager.MarkResponse(Buttons[currentButton].LEDPin, Buttons[currentButton].InputPin, reaction);
 
                 // Wait for the pin to be let go
-                while (IOManager.digitalRead(Buttons[currentButton].InputPin))
-                    ;
+                Scheduler.WaitForRelease(1 << Buttons[currentButton].InputPin);
 
                 // Turn off button LED
                 IOManager.digitalWrite(Buttons[currentButton].LEDPin, false);
@@ -236,13 +881,16 @@ void ReactionTimerGame()
     uBit.serial.send("AVG:");
     uBit.serial.send((int)sum);
     uBit.serial.send("\n\r");
-    uBit.display.scroll((int)sum);
+    Presenter.ShowNumber((int)sum, 1000);
+
+    return sum;
 }
 
 // Count how many buttons can be pressed within a 10 second timeframe.
-void ButtonCountGame()
+int ButtonCountGame()
 {
     // Clear anything off the display
+    Presenter.Skip();
     uBit.display.stopAnimation();
     uBit.display.clear();
 
@@ -271,25 +919,30 @@ void ButtonCountGame()
 
         // Enable the chosen button's LED
         IOManager.digitalWrite(Buttons[currentButton].LEDPin, true);
+        uint32_t time1 = us_ticker_read();
+        Scheduler.SetPhase(PhaseStimulus);
 
         while (1)
         {
 
             // Wait for them to press the button
-            while (!uBit.io.P8.getDigitalValue())
-                ;
+            char inputFlag = Scheduler.WaitForPress();
 
-            // Check which input changed
-            char inputFlag = IOManager.ReadPortB();
+            // A replay that has run out of presses ends the game early.
+            if (!inputFlag)
+            {
+                IOManager.digitalWrite(Buttons[currentButton].LEDPin, false);
+                return count;
+            }
 
             // Check if the chosen pin was pressed
             if (IOManager.isBitSetExclusive(inputFlag, Buttons[currentButton].InputPin))
             {
                 // The correct button was pressed!
+                IOManager.MarkResponse(Buttons[currentButton].LEDPin, Buttons[currentButton].InputPin, Scheduler.GetPressTime(Buttons[currentButton].InputPin) - time1);
 
                 // Wait for the pin to be let go.
-                while (IOManager.digitalRead(Buttons[currentButton].InputPin))
-                    ;
+                Scheduler.WaitForRelease(1 << Buttons[currentButton].InputPin);
 
                 // Turn off button LED
                 IOManager.digitalWrite(Buttons[currentButton].LEDPin, false);
@@ -307,13 +960,16 @@ void ButtonCountGame()
         }
     }
 
-    uBit.display.scroll(count);
+    Presenter.ShowNumber(count, 1000);
+
+    return count;
 }
 
 // Two player verses
-void VersusGame()
+int VersusGame()
 {
     // In this mode, there are two buttons "Left" and "Right". This refers to the Red/Blue Yellow/Green button combos for two player
+    Presenter.Skip();
     uBit.display.stopAnimation();
     uBit.display.clear();
 
@@ -326,8 +982,12 @@ void VersusGame()
     int player1Score = 0;
     int player2Score = 0;
 
+    // Each player's side of the board, pressing anything on your side before the buttons light is a jump start.
+    char player1Mask = (1 << Buttons[0].InputPin) | (1 << Buttons[1].InputPin);
+    char player2Mask = (1 << Buttons[3].InputPin) | (1 << Buttons[4].InputPin);
+
     // Do this 5 times (best of 5 then innit)
-    for (int i = 0; i < 5; i++)
+    for (int i = 0; i < VERSUS_ROUNDS; i++)
     {
 
         // Choose button in range 0-1
@@ -335,56 +995,127 @@ void VersusGame()
         // Translate to button2
         button2 = button1 + 3;
 
+        // Let the last result finish, a press skips it. The jump start window doesn't open until that press, or
+        // anything else still held from the last round, has been let go.
+        Scheduler.SetPhase(PhaseIdle);
+        Presenter.WaitUntilIdle(&Scheduler);
+        Scheduler.WaitForRelease(player1Mask | player2Mask);
+
+        // Count down, this can't be skipped.
         for (int i = 3; i > 0; i--)
         {
-            uBit.display.print(i);
-            wait_ms(1000);
+            Presenter.ShowNumber(i, 600, false);
         }
 
         // Wait between 0.25-2 seconds.
-        wait_ms(250 + ((rand() % 2) * 1000));
+        uint32_t delay = (250 + ((rand() % 2) * 1000)) * 1000;
+
+        // From the start of the countdown until the buttons light up, any press is a jump start.
+        Scheduler.SetPhase(PhaseCountdown);
+        IOManager.MarkWindow();
+        char jumpStart = 0;
+        while (Presenter.IsBusy() && !jumpStart)
+        {
+            jumpStart = WaitForJumpStart(PRESENTER_TICK * 1000, player1Mask | player2Mask);
+        }
+        if (!jumpStart)
+        {
+            jumpStart = WaitForJumpStart(delay, player1Mask | player2Mask);
+        }
+
+        if (jumpStart)
+        {
+            // Recorded so that a replay jumps the start too.
+            for (int pin = 0; pin < 8; pin++)
+            {
+                if (IOManager.isBitSet(jumpStart, pin))
+                {
+                    IOManager.MarkEarlyPress(pin, Scheduler.GetPressTime(pin));
+                }
+            }
+
+            // The other player gets the round, unless they both jumped.
+            bool player1Jumped = jumpStart & player1Mask;
+            bool player2Jumped = jumpStart & player2Mask;
+
+            Presenter.Skip();
+            if (player1Jumped && !player2Jumped)
+            {
+                Presenter.ShowGlyph('>', 1000);
+                player2Score++;
+            }
+            else if (player2Jumped && !player1Jumped)
+            {
+                Presenter.ShowGlyph('<', 1000);
+                player1Score++;
+            }
+            else
+            {
+                Presenter.ShowGlyph('?', 1000);
+            }
+
+            Scheduler.WaitForRelease(player1Mask | player2Mask);
+            continue;
+        }
 
         // Change display
-        uBit.display.print("!");
+        Presenter.ShowGlyph('!', 0, false);
 
-        // Turn on the chosen buttons
-        IOManager.digitalWrite(Buttons[button1].LEDPin, true);
-        IOManager.digitalWrite(Buttons[button2].LEDPin, true);
+        // Turn on the chosen buttons in a single write, so both players' LEDs light at the same moment.
+        char stimulus = (1 << Buttons[button1].LEDPin) | (1 << Buttons[button2].LEDPin);
+        IOManager.writeRegister(0x09, stimulus);
+        uint32_t time1 = us_ticker_read();
+        Scheduler.SetPhase(PhaseStimulus);
 
         while (1)
         {
 
             // Wait for them to press the button
-            while (!uBit.io.P8.getDigitalValue())
-                ;
+            char inputFlag = Scheduler.WaitForPress();
 
-            // Check which input changed
-            char inputFlag = IOManager.ReadPortB();
+            // A replay that has run out of presses ends the game early.
+            if (!inputFlag)
+            {
+                IOManager.writeRegister(0x09, 0x00);
+                return player1Score - player2Score;
+            }
 
             bool button1Pressed = IOManager.isBitSet(inputFlag, Buttons[button1].InputPin);
             bool button2Pressed = IOManager.isBitSet(inputFlag, Buttons[button2].InputPin);
+            uint32_t press1 = Scheduler.GetPressTime(Buttons[button1].InputPin);
+            uint32_t press2 = Scheduler.GetPressTime(Buttons[button2].InputPin);
+
+            // Both can come out of the same sample, one of them may still have been seen by an earlier read.
+            if (button1Pressed && button2Pressed && press1 != press2)
+            {
+                button1Pressed = (int32_t)(press1 - press2) < 0;
+                button2Pressed = !button1Pressed;
+            }
 
             if (button1Pressed && button2Pressed)
             {
-                // No idea who hit it first
-                uBit.display.print("?");
-                continue;
+                // No idea who hit it first, so nobody gets the round. Both LEDs lit together, so neither player
+                // would press again and waiting on the next press would never end.
+                Presenter.ShowGlyph('?', 1000);
+                IOManager.MarkResponse(Buttons[button1].LEDPin, Buttons[button1].InputPin, press1 - time1);
+                IOManager.MarkResponse(Buttons[button2].LEDPin, Buttons[button2].InputPin, press2 - time1);
+                Scheduler.WaitForRelease((1 << Buttons[button1].InputPin) | (1 << Buttons[button2].InputPin));
             }
             if (button1Pressed && !button2Pressed)
             {
                 // Player 1 Wins!
-                uBit.display.print("<");
+                Presenter.ShowGlyph('<', 1000);
                 player1Score++;
-                while (IOManager.digitalRead(Buttons[button1].InputPin))
-                    ;
+                IOManager.MarkResponse(Buttons[button1].LEDPin, Buttons[button1].InputPin, press1 - time1);
+                Scheduler.WaitForRelease(1 << Buttons[button1].InputPin);
             }
             if (!button1Pressed && button2Pressed)
             {
                 // Player 2 Wins!
-                uBit.display.print(">");
+                Presenter.ShowGlyph('>', 1000);
                 player2Score++;
-                while (IOManager.digitalRead(Buttons[button2].InputPin))
-                    ;
+                IOManager.MarkResponse(Buttons[button2].LEDPin, Buttons[button2].InputPin, press2 - time1);
+                Scheduler.WaitForRelease(1 << Buttons[button2].InputPin);
             }
             if (!button1Pressed && !button2Pressed)
             {
@@ -392,44 +1123,309 @@ void VersusGame()
                 continue;
             }
 
-            // Wait here for a few seconds to display who won
-            wait_ms(2000);
-
-            // Turn off button LEDs
-            IOManager.digitalWrite(Buttons[button1].LEDPin, false);
-            IOManager.digitalWrite(Buttons[button2].LEDPin, false);
+            // Turn off button LEDs, the winner stays on the display while the next round starts.
+            IOManager.writeRegister(0x09, 0x00);
             break;
         }
     }
 
-    uBit.display.print("!");
-    wait_ms(1000);
+    // Let the last result finish before the scores.
+    Scheduler.SetPhase(PhaseIdle);
+    Presenter.WaitUntilIdle(&Scheduler);
+    Presenter.ShowGlyph('!', 1000);
 
-    // Game Over, display the score. Do it a few times
+    // Game Over, display the score. Do it a few times. This plays while the menu is back up.
     for (int i = 0; i < 2; i++)
     {
-        uBit.display.print("<");
-        wait_ms(1000);
-        uBit.display.print(player1Score);
-        wait_ms(1000);
-        uBit.display.print(">");
-        wait_ms(1000);
-        uBit.display.print(player2Score);
-        wait_ms(1000);
+        Presenter.ShowGlyph('<', 1000);
+        Presenter.ShowNumber(player1Score, 1000);
+        Presenter.ShowGlyph('>', 1000);
+        Presenter.ShowNumber(player2Score, 1000);
     }
 
     for (int i = 0; i < 5; i++)
     {
-        if (player1Score > player2Score)
+        Presenter.ShowGlyph(player1Score > player2Score ? '<' : '>', 500);
+        Presenter.ShowClear(500);
+    }
+
+    // Positive when player 1 won.
+    return player1Score - player2Score;
+}
+
+int SelectPlayerCount()
+{
+    int players = 2;
+
+    // Same controls as the main menu.
+    IOManager.digitalWrite(Buttons[0].LEDPin, true);
+    IOManager.digitalWrite(Buttons[2].LEDPin, true);
+    IOManager.digitalWrite(Buttons[4].LEDPin, true);
+
+    Presenter.Skip();
+    Scheduler.SetPhase(PhaseIdle);
+
+    while (1)
+    {
+        // Only do anything when the idle policy says it is time for a sample.
+        if (!Scheduler.Poll())
+        {
+            Scheduler.Idle();
+            continue;
+        }
+
+        uBit.display.print(players);
+
+        char inputFlag = Scheduler.GetState();
+
+        if (IOManager.isBitSetExclusive(inputFlag, Buttons[0].InputPin))
+        {
+            if (players > 1)
+            {
+                players--;
+            }
+        }
+        else if (IOManager.isBitSetExclusive(inputFlag, Buttons[4].InputPin))
+        {
+            if (players < MULTI_MAX_PLAYERS)
+            {
+                players++;
+            }
+        }
+        else if (IOManager.isBitSetExclusive(inputFlag, Buttons[2].InputPin))
+        {
+            IOManager.writeRegister(0x09, 0x00);
+            Scheduler.WaitForRelease(ALL_INPUTS);
+            return players;
+        }
+        else
+        {
+            Scheduler.Idle();
+            continue;
+        }
+
+        // Wait until they let go of the button.
+        Scheduler.WaitForRelease(ALL_INPUTS);
+    }
+}
+
+// Time until a player's next stimulus, between 1 and 3 seconds (us).
+uint32_t MultiPlayerDelay()
+{
+    return (1000 + (rand() % 2000)) * 1000;
+}
+
+int MultiPlayerGame(int players)
+{
+    // Player n uses Buttons[n], each player gets their own LED timing.
+    Presenter.Skip();
+    uBit.display.stopAnimation();
+    uBit.display.clear();
+
+    PlayerStats stats[MULTI_MAX_PLAYERS];
+    uint32_t due[MULTI_MAX_PLAYERS];
+    uint32_t litTime[MULTI_MAX_PLAYERS];
+    bool lit[MULTI_MAX_PLAYERS];
+    bool held[MULTI_MAX_PLAYERS];
+
+    uint32_t now = us_ticker_read();
+    for (int p = 0; p < players; p++)
+    {
+        stats[p].Reactions = 0;
+        stats[p].Sum = 0;
+        stats[p].Best = MULTI_NO_BEST;
+        stats[p].FalseStarts = 0;
+        due[p] = now + MultiPlayerDelay();
+        lit[p] = false;
+        held[p] = false;
+    }
+
+    Presenter.ShowGlyph('!', 0, false);
+
+    // Every player is waiting on a stimulus for the whole game, early presses are caught below.
+    Scheduler.SetPhase(PhaseStimulus);
+
+    // Outputs we want, and what was last written to the expander.
+    char outputs = 0;
+    char written = 0;
+    IOManager.writeRegister(0x09, written);
+
+    // False starts can happen at any point in the game, they're timed from here.
+    IOManager.MarkWindow();
+
+    int remaining = players;
+    while (remaining > 0)
+    {
+        now = us_ticker_read();
+        for (int p = 0; p < players; p++)
         {
-            uBit.display.print("<");
+            if (lit[p] || stats[p].Reactions >= MULTI_ROUNDS)
+            {
+                continue;
+            }
+
+            if ((int32_t)(now - due[p]) >= 0)
+            {
+                outputs |= 1 << Buttons[p].LEDPin;
+            }
+        }
+
+        // Every LED change goes out in a single write, so nobody's stimulus waits on anyone else's.
+        if (outputs != written)
+        {
+            IOManager.writeRegister(0x09, outputs);
+            uint32_t writeTime = us_ticker_read();
+
+            for (int p = 0; p < players; p++)
+            {
+                if (!lit[p] && IOManager.isBitSet(outputs, Buttons[p].LEDPin))
+                {
+                    lit[p] = true;
+                    litTime[p] = writeTime;
+                }
+            }
+            written = outputs;
+        }
+
+        // One sample covers every player, each press is timed from the read that first saw it.
+        Scheduler.Poll();
+        char inputFlag = Scheduler.GetState();
+        now = us_ticker_read();
+
+        for (int p = 0; p < players; p++)
+        {
+            bool pressed = IOManager.isBitSet(inputFlag, Buttons[p].InputPin);
+            uint32_t pressTime = Scheduler.GetPressTime(Buttons[p].InputPin);
+            bool finished = false;
+
+            if (pressed && !held[p])
+            {
+                if (lit[p])
+                {
+                    uint32_t reaction = pressTime - litTime[p];
+                    IOManager.MarkResponse(Buttons[p].LEDPin, Buttons[p].InputPin, reaction);
+
+                    stats[p].Sum += reaction;
+                    if (reaction < stats[p].Best)
+                    {
+                        stats[p].Best = reaction;
+                    }
+                    finished = true;
+                }
+                else if (stats[p].Reactions < MULTI_ROUNDS)
+                {
+                    // Jumped the gun, their next LED is pushed back too.
+                    IOManager.MarkEarlyPress(Buttons[p].InputPin, pressTime);
+                    stats[p].FalseStarts++;
+                    due[p] = pressTime + MultiPlayerDelay();
+                }
+            }
+            else if (lit[p] && now - litTime[p] > MULTI_TIMEOUT)
+            {
+                // Nobody pressed it.
+                stats[p].Sum += MULTI_TIMEOUT;
+                finished = true;
+            }
+
+            if (finished)
+            {
+                lit[p] = false;
+                outputs &= ~(1 << Buttons[p].LEDPin);
+
+                stats[p].Reactions++;
+                if (stats[p].Reactions == MULTI_ROUNDS)
+                {
+                    remaining--;
+                }
+                else
+                {
+                    due[p] = now + MultiPlayerDelay();
+                }
+            }
+
+            held[p] = pressed;
+        }
+
+        // Nothing else happens until the next LED is due or a lit one times out.
+        uint32_t next = now + MULTI_TIMEOUT;
+        for (int p = 0; p < players; p++)
+        {
+            uint32_t deadline = lit[p] ? litTime[p] + MULTI_TIMEOUT + 1 : due[p];
+            if (stats[p].Reactions < MULTI_ROUNDS && (int32_t)(deadline - next) < 0)
+            {
+                next = deadline;
+            }
+        }
+        Scheduler.Idle(next);
+    }
+
+    IOManager.writeRegister(0x09, 0x00);
+
+    // Rank by average reaction time, with the false start penalties added on.
+    uint32_t score[MULTI_MAX_PLAYERS];
+    int ranking[MULTI_MAX_PLAYERS];
+    for (int p = 0; p < players; p++)
+    {
+        score[p] = (stats[p].Sum + stats[p].FalseStarts * MULTI_FALSE_START_PENALTY) / MULTI_ROUNDS;
+
+        // Insert into the ranking, fastest first.
+        int r = p;
+        while (r > 0 && score[ranking[r - 1]] > score[p])
+        {
+            ranking[r] = ranking[r - 1];
+            r--;
+        }
+        ranking[r] = p;
+    }
+
+    for (int r = 0; r < players; r++)
+    {
+        int p = ranking[r];
+
+        uBit.serial.send("RANK:");
+        uBit.serial.send(r + 1);
+        uBit.serial.send(" PLAYER:");
+        uBit.serial.send(p + 1);
+        uBit.serial.send(" AVG(ms):");
+        uBit.serial.send((int)(stats[p].Sum / MULTI_ROUNDS / 1000));
+        // What the ranking goes on, the average with the false start penalties added.
+        uBit.serial.send(" SCORE(ms):");
+        uBit.serial.send((int)(score[p] / 1000));
+        uBit.serial.send(" BEST(ms):");
+        if (stats[p].Best == MULTI_NO_BEST)
+        {
+            uBit.serial.send("-");
         }
         else
         {
-            uBit.display.print(">");
+            uBit.serial.send((int)(stats[p].Best / 1000));
+        }
+        uBit.serial.send(" FALSE:");
+        uBit.serial.send(stats[p].FalseStarts);
+        uBit.serial.send("\n\r");
+
+        // Players are shown in ranked order, fastest average first.
+        Presenter.ShowNumber(p + 1, 800);
+        Presenter.ShowClear(200);
+    }
+
+    // The winning player.
+    return ranking[0] + 1;
+}
+
+char WaitForJumpStart(uint32_t time, char mask)
+{
+    uint32_t start = us_ticker_read();
+    uint32_t elapsed = 0;
+
+    // Presses on buttons outside the mask don't count, so keep waiting through them.
+    while ((elapsed = us_ticker_read() - start) < time)
+    {
+        char pressed = Scheduler.Wait(time - elapsed) & mask;
+        if (pressed)
+        {
+            return pressed;
         }
-        wait_ms(500);
-        uBit.display.clear();
-        wait_ms(500);
     }
-}
\ No newline at end of file
+    return 0;
+}